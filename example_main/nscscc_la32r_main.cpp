@@ -4,27 +4,47 @@
 #include <termios.h>
 #include <unistd.h>
 #include <thread>
+#include <chrono>
 #include <signal.h>
+#include <cerrno>
 
 #include "device/nscscc_confreg.hpp"
 #include "device/uart8250.hpp"
+#include "device/host_clock.hpp"
+#include "device/host_input.hpp"
+#include "device/event_queue.hpp"
+#include "device/irq_line.hpp"
+#include "device/console_output.hpp"
+#include "device/checkpoint.hpp"
 #include "memory/memory_bus.hpp"
+#include "memory/static_map.hpp"
 #include "memory/ram.hpp"
 #include "core/la32r/la32r_core.hpp"
 
-void uart_input(uart8250 &uart) {
+// stdin and Ctrl-C, read by the uart input thread only
+host_input keyboard;
+
+void uart_input(uart8250 &uart, host_clock *clock) {
     termios tmp;
     tcgetattr(STDIN_FILENO, &tmp);
     tmp.c_lflag &= (~ICANON & ~ECHO);
     tcsetattr(STDIN_FILENO, TCSANOW, &tmp);
+    char buf[256];
     while (true) {
-        char c = getchar();
-        if (c == 10) c = 13; // convert lf to cr
-        uart.putc(c);
+        // hand whole bursts to the uart so the guest sees one interrupt per FIFO trigger level
+        ssize_t n = keyboard.read(buf, sizeof(buf));
+        if (n <= 0) break;
+        for (ssize_t i = 0; i < n; i++) if (buf[i] == 10) buf[i] = 13; // convert lf to cr
+        uart.putc(buf, n);
+        if (clock) clock->notify();
     }
 }
 
 bool send_ctrl_c;
+volatile sig_atomic_t save_requested;
+
+// stable counter frequency assumed by the kernel, used with -realtime
+const uint64_t timer_freq = 100000000;
 
 void sigint_handler(int x) {
     static time_t last_time;
@@ -33,8 +53,33 @@ void sigint_handler(int x) {
     send_ctrl_c = true;
 }
 
+void sigusr1_handler(int x) {
+    save_requested = true;
+}
+
+// Machines below are fixed, their buses decode at compile time.
+
+// func test: program memory, data memories behind each window, confreg in both segments
+typedef basic_memory_bus<static_map<
+    static_range<0x1c000000, 0x100000, ram>,
+    static_range<0x00000000, 0x1000000, ram>,
+    static_range<0x80000000, 0x1000000, ram>,
+    static_range<0x90000000, 0x1000000, ram>,
+    static_range<0xa0000000, 0x1000000, ram>,
+    static_range<0xc0000000, 0x1000000, ram>,
+    static_range<0xd0000000, 0x1000000, ram>,
+    static_range<0xe0000000, 0x1000000, ram>,
+    static_range<0x1faf0000, 0x10000, nscscc_confreg>,
+    static_range<0xbfaf0000, 0x10000, nscscc_confreg>
+> > func_bus;
+
+// linux and ucore: 128MiB memory, uart8250 at 0x1fe001e0
+typedef basic_memory_bus<static_map<
+    static_range<0, 128 * 1024 * 1024, ram>,
+    static_range<0x1fe001e0, 0x10, uart8250>
+> > soc_bus;
+
 int nscscc_func(int argc, const char *argv[]) {
-    memory_bus mmio;
 
     ram func_mem(1024 * 1024, "./func_lab19.bin");
     ram data_mem0(0x1000000);
@@ -45,42 +90,46 @@ int nscscc_func(int argc, const char *argv[]) {
     ram data_mem5(0x1000000);
     func_mem.set_allow_warp(true);
 
-    nscscc_confreg confreg(true);
+    event_queue events;
+    nscscc_confreg confreg(events, true);
 
-    assert(mmio.add_dev(0x1c000000, 0x100000, &func_mem));
-    assert(mmio.add_dev(0x00000000, 0x1000000, &data_mem0));
-    assert(mmio.add_dev(0x80000000, 0x1000000, &data_mem1));
-    assert(mmio.add_dev(0x90000000, 0x1000000, &data_mem2));
-    assert(mmio.add_dev(0xa0000000, 0x1000000, &data_mem1));
-    assert(mmio.add_dev(0xc0000000, 0x1000000, &data_mem3));
-    assert(mmio.add_dev(0xd0000000, 0x1000000, &data_mem4));
-    assert(mmio.add_dev(0xe0000000, 0x1000000, &data_mem5));
-    assert(mmio.add_dev(0x1faf0000, 0x10000, &confreg));
-    assert(mmio.add_dev(0xbfaf0000, 0x10000, &confreg));
+    func_bus mmio(func_mem, data_mem0, data_mem1, data_mem2, data_mem1, data_mem3, data_mem4, data_mem5, confreg, confreg);
 
-    la32r_core<32> core(0, mmio, true);
+    la32r_core<32, func_bus> core(0, mmio, events, true);
     while (!core.is_end()) {
+        events.tick();
         core.step();
-        confreg.tick();
     }
     return 0;
 }
 
 int linux_run(int argc, const char *argv[]) {
     signal(SIGINT, sigint_handler);
+    signal(SIGUSR1, sigusr1_handler);
+
+    // -save writes a checkpoint on SIGUSR1, -restore continues from one
+    bool realtime = false;
+    const char *save_path = nullptr, *restore_path = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-realtime") == 0) realtime = true;
+        if (strcmp(argv[i], "-save") == 0 && i + 1 < argc) save_path = argv[++i];
+        if (strcmp(argv[i], "-restore") == 0 && i + 1 < argc) restore_path = argv[++i];
+    }
+    host_clock clock(timer_freq);
+    uint64_t sync_cnt = 0;
 
-    memory_bus cemu_mmio;
+    event_queue events;
 
     ram cemu_memory(128 * 1024 * 1024);
     cemu_memory.load_binary(0x300000, "./vmlinux.bin");
     cemu_memory.load_text(0x5f00000, "./init_5f.txt");
-    assert(cemu_mmio.add_dev(0, 128 * 1024 * 1024, &cemu_memory));
 
     uart8250 uart;
-    std::thread *uart_input_thread = new std::thread(uart_input, std::ref(uart));
-    assert(cemu_mmio.add_dev(0x1fe001e0, 0x10, &uart));
+    irq_pins pins;
+    uart.connect_irq(&pins, 1);
+    soc_bus cemu_mmio(cemu_memory, uart);
 
-    la32r_core<32> core(0, cemu_mmio, false);
+    la32r_core<32, soc_bus> core(0, cemu_mmio, events, false);
     core.csr_cfg(0x180, 0xa0000001u);
     core.csr_cfg(0x181, 0x00000001u);
     core.csr_cfg(0x0, 0x10);
@@ -89,17 +138,43 @@ int linux_run(int argc, const char *argv[]) {
     core.reg_cfg(6, 0xa5f00080u);
     core.jump(0xa07c5c28u);
 
+    auto machine_checkpoint = [&](const char *path, checkpoint::mode_t mode) {
+        checkpoint cp(path, mode);
+        events.serialize(cp);
+        cemu_memory.serialize(cp);
+        uart.serialize(cp);
+        core.serialize(cp);
+        if (!cp.good()) std::cerr << "failed to " << (mode == checkpoint::SAVE ? "save" : "restore") << " checkpoint " << path << std::endl;
+        return cp.good();
+    };
+    if (restore_path) {
+        if (!machine_checkpoint(restore_path, checkpoint::RESTORE)) exit(1);
+        clock.set_now(events.now());
+    }
+    // host I/O threads start once the machine state is final
+    std::thread *uart_input_thread = new std::thread(uart_input, std::ref(uart), &clock);
+    console_output console(console_output::NEWLINE_DROP_CR);
+    console.attach(uart);
+
     while (!core.is_end()) {
-        core.step(uart.irq() << 1);
-        while (uart.exist_tx()) {
-            char c = uart.getc();
-            if (c != '\r') {
-                putchar(c);
-                fflush(stdout);
+        if (!realtime) events.tick();
+        else if ((++sync_cnt & 1023) == 0) events.set_time(clock.now());
+        core.step(pins.get());
+        if (core.is_idle()) {
+            uint64_t ticks = events.next_event();
+            if (realtime) {
+                clock.wait_until(ticks == UINT64_MAX ? UINT64_MAX : events.now() + ticks);
+                events.set_time(clock.now());
             }
+            else if (ticks == UINT64_MAX) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            else if (ticks > 1) events.advance(ticks - 1);
+        }
+        if (save_requested && save_path) {
+            if (machine_checkpoint(save_path, checkpoint::SAVE)) std::cerr << "checkpoint saved to " << save_path << std::endl;
+            save_requested = false;
         }
         if (send_ctrl_c) {
-            uart.putc(3);
+            keyboard.send_ctrl_c();
             send_ctrl_c = false;
         }
     }
@@ -109,32 +184,34 @@ int linux_run(int argc, const char *argv[]) {
 int ucore_run(int argc, const char *argv[]) {
     signal(SIGINT, sigint_handler);
 
-    memory_bus cemu_mmio;
+    event_queue events;
 
     ram cemu_memory(128 * 1024 * 1024);
     cemu_memory.load_binary(0x000000, "./ucore-kernel-initrd.bin");
-    assert(cemu_mmio.add_dev(0, 128 * 1024 * 1024, &cemu_memory));
 
     uart8250 uart;
-    std::thread *uart_input_thread = new std::thread(uart_input, std::ref(uart));
-    assert(cemu_mmio.add_dev(0x1fe001e0, 0x10, &uart));
-
-    la32r_core<32> core(0, cemu_mmio, false);
+    irq_pins pins;
+    uart.connect_irq(&pins, 1);
+    std::thread *uart_input_thread = new std::thread(uart_input, std::ref(uart), nullptr);
+    console_output console(console_output::NEWLINE_DROP_CR);
+    console.attach(uart);
+    soc_bus cemu_mmio(cemu_memory, uart);
+
+    la32r_core<32, soc_bus> core(0, cemu_mmio, events, false);
     core.csr_cfg(0x180, 0xa0000011u);
     core.csr_cfg(0x181, 0x80000001u);
     core.csr_cfg(0x0, 0xb0);
     core.jump(0xa0000000u);
     while (!core.is_end()) {
-        core.step(uart.irq() << 1);
-        while (uart.exist_tx()) {
-            char c = uart.getc();
-            if (c != '\r') {
-                putchar(c);
-                fflush(stdout);
-            }
+        events.tick();
+        core.step(pins.get());
+        if (core.is_idle()) {
+            uint64_t ticks = events.next_event();
+            if (ticks == UINT64_MAX) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            else if (ticks > 1) events.advance(ticks - 1);
         }
         if (send_ctrl_c) {
-            uart.putc(3);
+            keyboard.send_ctrl_c();
             send_ctrl_c = false;
         }
     }
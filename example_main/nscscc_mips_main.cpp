@@ -2,52 +2,81 @@
 #include <bitset>
 #include <cassert>
 #include <thread>
+#include <chrono>
 #include <termios.h>
 #include <cassert>
 #include <unistd.h>
 #include <csignal>
 #include <fcntl.h>
+#include <cerrno>
 
 #include "mips_core.hpp"
 #include "nscscc_confreg.hpp"
 #include "memory_bus.hpp"
+#include "static_map.hpp"
 #include "ram.hpp"
 #include "uart8250.hpp"
+#include "host_clock.hpp"
+#include "host_input.hpp"
+#include "event_queue.hpp"
+#include "irq_line.hpp"
+#include "console_output.hpp"
+#include "checkpoint.hpp"
 
-void uart_input(uart8250 &uart) {
+// stdin and Ctrl-C, read by the uart input thread only
+host_input keyboard;
+
+void uart_input(uart8250 &uart, host_clock *clock) {
     termios tmp;
     tcgetattr(STDIN_FILENO,&tmp);
     tmp.c_lflag &=(~ICANON & ~ECHO);
     tcsetattr(STDIN_FILENO,TCSANOW,&tmp);
+    char buf[256];
     while (true) {
-        char c = getchar();
-        if (c == 10) c = 13; // convert lf to cr
-        uart.putc(c);
+        // hand whole bursts to the uart so the guest sees one interrupt per FIFO trigger level
+        ssize_t n = keyboard.read(buf,sizeof(buf));
+        if (n <= 0) break;
+        for (ssize_t i=0;i<n;i++) if (buf[i] == 10) buf[i] = 13; // convert lf to cr
+        uart.putc(buf,n);
+        if (clock) clock->notify();
     }
 }
 
+// Machines below are fixed, their buses decode at compile time.
+
+// func and perf tests: one memory aliased at every window, confreg
+typedef basic_memory_bus<static_map<
+    static_range<0x1fc00000, 0x100000, ram>,
+    static_range<0x00000000, 0x10000000, ram>,
+    static_range<0x20000000, 0x20000000, ram>,
+    static_range<0x40000000, 0x40000000, ram>,
+    static_range<0x80000000, 0x80000000, ram>,
+    static_range<0x1faf0000, 0x10000, nscscc_confreg>
+> > nscscc_bus;
+
+// ucore and linux: 128MiB memory, uart8250 at 0x1fe40000 (APB)
+typedef basic_memory_bus<static_map<
+    static_range<0, 128*1024*1024, ram>,
+    static_range<0x1fe40000, 0x10000, uart8250>
+> > soc_bus;
+
 void nscscc_func() {
-    memory_bus mmio;
-    
     ram func_mem(262144*4, "../nscscc-group/func_test_v0.01/soft/func/obj/main.bin");
     func_mem.set_allow_warp(true);
-    assert(mmio.add_dev(0x1fc00000,0x100000  ,&func_mem));
-    assert(mmio.add_dev(0x00000000,0x10000000,&func_mem));
-    assert(mmio.add_dev(0x20000000,0x20000000,&func_mem));
-    assert(mmio.add_dev(0x40000000,0x40000000,&func_mem));
-    assert(mmio.add_dev(0x80000000,0x80000000,&func_mem));
 
-    nscscc_confreg confreg(true);
+    event_queue events;
+    nscscc_confreg confreg(events, true);
     confreg.set_trace_file("../nscscc-group/func_test_v0.01/cpu132_gettrace/golden_trace.txt");
-    assert(mmio.add_dev(0x1faf0000,0x10000,&confreg));
 
-    mips_core mips(mmio);
+    nscscc_bus mmio(func_mem, func_mem, func_mem, func_mem, func_mem, confreg);
+
+    mips_core<8, nscscc_bus> mips(mmio, events);
 
     uint32_t test_point = 0;
     bool running = true;
     while (running) {
+        events.tick();
         mips.step();
-        confreg.tick();
         running = confreg.do_trace(mips.debug_wb_pc, mips.debug_wb_wen, mips.debug_wb_wnum, mips.debug_wb_wdata);
         while (confreg.has_uart()) printf("%c", confreg.get_uart());
         if (confreg.get_num() != test_point) {
@@ -59,27 +88,22 @@ void nscscc_func() {
 }
 
 void nscscc_perf() {
-    memory_bus mmio;
-    
     ram perf_mem(262144*4, "../nscscc-group/perf_test_v0.01/soft/perf_func/obj/allbench/inst_data.bin");
     perf_mem.set_allow_warp(true);
-    assert(mmio.add_dev(0x1fc00000,0x100000  ,&perf_mem));
-    assert(mmio.add_dev(0x00000000,0x10000000,&perf_mem));
-    assert(mmio.add_dev(0x20000000,0x20000000,&perf_mem));
-    assert(mmio.add_dev(0x40000000,0x40000000,&perf_mem));
-    assert(mmio.add_dev(0x80000000,0x80000000,&perf_mem));
 
-    nscscc_confreg confreg(false);
-    assert(mmio.add_dev(0x1faf0000,0x10000,&confreg));
+    event_queue events;
+    nscscc_confreg confreg(events, false);
+
+    nscscc_bus mmio(perf_mem, perf_mem, perf_mem, perf_mem, perf_mem, confreg);
 
-    mips_core mips(mmio);
+    mips_core<8, nscscc_bus> mips(mmio, events);
 
     for (int test_num=1;test_num<=10;test_num ++) {
         confreg.set_switch(test_num);
         mips.reset();
         while (true) {
+            events.tick();
             mips.step();
-            confreg.tick();
             if (mips.get_pc() == 0xbfc00100u) break;
         }
         // printf("%x\n",confreg.get_num());
@@ -92,6 +116,10 @@ void nscscc_perf() {
 }
 
 bool send_ctrl_c;
+volatile sig_atomic_t save_requested;
+
+// CP0 Count frequency assumed by the kernel (mips_hpt_frequency), used with -realtime
+const uint64_t timer_freq = 100000000;
 
 void sigint_handler(int x) {
     static time_t last_time;
@@ -100,42 +128,42 @@ void sigint_handler(int x) {
     send_ctrl_c = true;
 }
 
+void sigusr1_handler(int x) {
+    save_requested = true;
+}
+
 void ucore_run(int argc, const char* argv[]) {
     signal(SIGINT, sigint_handler);
 
-    memory_bus cemu_mmio;
+    event_queue events;
 
     ram cemu_memory(128*1024*1024, "../ucore-thumips/obj/ucore-kernel-initrd.bin");
-    assert(cemu_mmio.add_dev(0,128*1024*1024,&cemu_memory));
 
     // uart8250 at 0x1fe40000 (APB)
     uart8250 uart;
-    std::thread *uart_input_thread = new std::thread(uart_input,std::ref(uart));
-    assert(cemu_mmio.add_dev(0x1fe40000,0x10000,&uart));
+    irq_pins pins;
+    uart.connect_irq(&pins,1);
+    std::thread *uart_input_thread = new std::thread(uart_input,std::ref(uart),nullptr);
+    console_output console(console_output::NEWLINE_CRLF_TO_LF);
+    console.attach(uart);
+    soc_bus cemu_mmio(cemu_memory, uart);
 
-    mips_core mips(cemu_mmio);
+    mips_core<8, soc_bus> mips(cemu_mmio, events);
     mips.jump(0x80000000u);
     uint32_t lastpc = 0;
-    bool delay_cr = false;
     while (true) {
-        mips.step(uart.irq() << 1);
-        while (uart.exist_tx()) {
-            char c = uart.getc();
-            if (c == '\r') delay_cr = true;
-            else {
-                if (delay_cr && c != '\n') std::cout << "\r" << c;
-                else std::cout << c;
-                std::cout.flush();
-                delay_cr = false;
-            }
-            // uart_history[uart_history_idx] = c;
-            // uart_history_idx = (uart_history_idx + 1) % 8;
+        events.tick();
+        mips.step(pins.get());
+        if (mips.is_idle()) {
+            uint64_t ticks = events.next_event();
+            if (ticks == UINT64_MAX) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            else if (ticks > 1) events.advance(ticks - 1);
         }
         if (send_ctrl_c) {
-            uart.putc(3);
+            keyboard.send_ctrl_c();
             send_ctrl_c = false;
         }
-        if (mips.get_pc() == lastpc) {
+        if (!mips.is_idle() && mips.get_pc() == lastpc) {
             printf("error!\n");
             exit(1);
         }
@@ -145,41 +173,69 @@ void ucore_run(int argc, const char* argv[]) {
 
 void linux_run(int argc, const char* argv[]) {
     signal(SIGINT, sigint_handler);
+    signal(SIGUSR1, sigusr1_handler);
 
-    memory_bus cemu_mmio;
+    // -save writes a checkpoint on SIGUSR1, -restore continues from one
+    bool realtime = false;
+    const char *save_path = nullptr, *restore_path = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-realtime") == 0) realtime = true;
+        if (strcmp(argv[i], "-save") == 0 && i + 1 < argc) save_path = argv[++i];
+        if (strcmp(argv[i], "-restore") == 0 && i + 1 < argc) restore_path = argv[++i];
+    }
+    host_clock clock(timer_freq);
+    uint64_t sync_cnt = 0;
+
+    event_queue events;
 
     ram cemu_memory(128*1024*1024);
     cemu_memory.load_binary(0x100000, "../linux/vmlinux.bin");
-    assert(cemu_mmio.add_dev(0,128*1024*1024,&cemu_memory));
 
     // uart8250 at 0x1fe40000 (APB)
     uart8250 uart;
-    std::thread *uart_input_thread = new std::thread(uart_input,std::ref(uart));
-    assert(cemu_mmio.add_dev(0x1fe40000,0x10000,&uart));
+    irq_pins pins;
+    uart.connect_irq(&pins,1);
+    soc_bus cemu_mmio(cemu_memory, uart);
 
-    mips_core mips(cemu_mmio);
+    mips_core<8, soc_bus> mips(cemu_mmio, events);
     mips.jump(0x80100000u);
+    auto machine_checkpoint = [&](const char *path, checkpoint::mode_t mode) {
+        checkpoint cp(path, mode);
+        events.serialize(cp);
+        cemu_memory.serialize(cp);
+        uart.serialize(cp);
+        mips.serialize(cp);
+        if (!cp.good()) std::cerr << "failed to " << (mode == checkpoint::SAVE ? "save" : "restore") << " checkpoint " << path << std::endl;
+        return cp.good();
+    };
+    if (restore_path) {
+        if (!machine_checkpoint(restore_path, checkpoint::RESTORE)) exit(1);
+        clock.set_now(events.now());
+    }
+    // host I/O threads start once the machine state is final
+    std::thread *uart_input_thread = new std::thread(uart_input,std::ref(uart),&clock);
+    console_output console(console_output::NEWLINE_DROP_CR);
+    console.attach(uart);
     uint32_t lastpc = 0;
-    bool delay_cr = false;
     while (true) {
-        mips.step(uart.irq() << 1);
-        while (uart.exist_tx()) {
-            char c = uart.getc();
-            if (c != '\r') std::cout << c;
-            /*
-            if (c == '\r') delay_cr = true;
-            else {
-                if (delay_cr && c != '\n') std::cout << "\r" << c;
-                else std::cout << c;
-                std::cout.flush();
-                delay_cr = false;
+        if (!realtime) events.tick();
+        else if ((++sync_cnt & 1023) == 0) events.set_time(clock.now());
+        mips.step(pins.get());
+        if (mips.is_idle()) {
+            uint64_t ticks = events.next_event();
+            if (realtime) {
+                clock.wait_until(ticks == UINT64_MAX ? UINT64_MAX : events.now() + ticks);
+                events.set_time(clock.now());
             }
-            */
-            // uart_history[uart_history_idx] = c;
-            // uart_history_idx = (uart_history_idx + 1) % 8;
+            else if (ticks == UINT64_MAX) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            else if (ticks > 1) events.advance(ticks - 1);
+        }
+        if (save_requested && save_path) {
+            if (machine_checkpoint(save_path, checkpoint::SAVE)) std::cerr << "checkpoint saved to " << save_path << std::endl;
+            save_requested = false;
         }
         if (send_ctrl_c) {
-            uart.putc(3);
+            keyboard.send_ctrl_c();
             send_ctrl_c = false;
         }
         /*
@@ -190,7 +246,7 @@ void linux_run(int argc, const char* argv[]) {
             break;
         }
         */
-        if (mips.get_pc() == lastpc) {
+        if (!mips.is_idle() && mips.get_pc() == lastpc) {
             printf("instruction retired=%d\n", mips.insret);
             while (!mips.pc_trace.empty()) {
                 printf("%x\n",mips.pc_trace.front());
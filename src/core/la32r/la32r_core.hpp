@@ -9,17 +9,17 @@
 #include <cassert>
 #include <queue>
 
-template<int nr_tlb_entry = 32>
+template<int nr_tlb_entry = 32, typename bus_t = memory_bus>
 class la32r_core {
 public:
-    la32r_core(uint32_t core_id, memory_bus &bus, bool trace) : mmu(bus), csr(core_id, pc, mmu), trace(trace) {
+    la32r_core(uint32_t core_id, bus_t &bus, event_queue &events, bool trace) : trace(trace), events(events), mmu(bus), csr(core_id, pc, mmu, events) {
         reset();
     }
 
     void reset() {
         idle = false;
         end = false;
-        counter = 0;
+        counter_base = events.now();
         pc = 0x1c000000u;
         memset(GPR, 0, sizeof(GPR));
         mmu.reset();
@@ -50,6 +50,21 @@ public:
         return end;
     }
 
+    bool is_idle() {
+        return idle;
+    }
+
+    void serialize(checkpoint &cp) {
+        cp.section("la32r_core");
+        cp.io(idle);
+        cp.io(end);
+        cp.io(counter_base);
+        cp.io(pc);
+        cp.io(GPR);
+        mmu.serialize(cp);
+        csr.serialize(cp);
+    }
+
 private:
     void exec(uint8_t exc_int) {
         la32r_instr instr;
@@ -58,7 +73,6 @@ private:
         bool cur_control_trans = false;
         bool ine = false;
         GPR[0] = 0;
-        counter += 1;
         pc_trace.push(pc);
         while (pc_trace.size() > 16) {
             pc_trace.pop();
@@ -162,7 +176,7 @@ private:
                 case LL_W: {
                     uint32_t temp;
                     uint32_t va = GPR[instr._2ri14.rj] + (instr._2ri14.i14 << 2);
-                    la32r_exccode exc = mmu.va_read(va, 4, (char * ) & temp,
+                    la32r_exccode exc = mmu.va_read(va, temp,
                                                     csr.get_cur_plv(),
                                                     csr.get_crmd_pg(),
                                                     csr.get_asid());
@@ -177,7 +191,7 @@ private:
                 case SC_W: {
                     uint32_t va = GPR[instr._2ri14.rj] + (instr._2ri14.i14 << 2);
                     if (csr.get_llbit()) {
-                        la32r_exccode exc = mmu.va_write(va, 4, (char * ) & GPR[instr._2ri14.rd],
+                        la32r_exccode exc = mmu.va_write(va, (uint32_t)GPR[instr._2ri14.rd],
                                                          csr.get_cur_plv(),
                                                          csr.get_crmd_pg(),
                                                          csr.get_asid());
@@ -231,7 +245,7 @@ private:
                     case LD_B: {
                         uint32_t va = GPR[instr._2ri12.rj] + instr._2ri12.i12;
                         int8_t temp;
-                        la32r_exccode exc = mmu.va_read(va, 1, (char * ) & temp,
+                        la32r_exccode exc = mmu.va_read(va, temp,
                                                         csr.get_cur_plv(),
                                                         csr.get_crmd_pg(),
                                                         csr.get_asid());
@@ -245,7 +259,7 @@ private:
                     case LD_H: {
                         uint32_t va = GPR[instr._2ri12.rj] + instr._2ri12.i12;
                         int16_t temp;
-                        la32r_exccode exc = mmu.va_read(va, 2, (char * ) & temp,
+                        la32r_exccode exc = mmu.va_read(va, temp,
                                                         csr.get_cur_plv(),
                                                         csr.get_crmd_pg(),
                                                         csr.get_asid());
@@ -259,7 +273,7 @@ private:
                     case LD_W: {
                         uint32_t va = GPR[instr._2ri12.rj] + instr._2ri12.i12;
                         int32_t temp;
-                        la32r_exccode exc = mmu.va_read(va, 4, (char * ) & temp,
+                        la32r_exccode exc = mmu.va_read(va, temp,
                                                         csr.get_cur_plv(),
                                                         csr.get_crmd_pg(),
                                                         csr.get_asid());
@@ -272,7 +286,7 @@ private:
                     }
                     case ST_B: {
                         uint32_t va = GPR[instr._2ri12.rj] + instr._2ri12.i12;
-                        la32r_exccode exc = mmu.va_write(va, 1, (char * ) & GPR[instr._2ri12.rd],
+                        la32r_exccode exc = mmu.va_write(va, (uint8_t)GPR[instr._2ri12.rd],
                                                          csr.get_cur_plv(),
                                                          csr.get_crmd_pg(),
                                                          csr.get_asid());
@@ -283,7 +297,7 @@ private:
                     }
                     case ST_H: {
                         uint32_t va = GPR[instr._2ri12.rj] + instr._2ri12.i12;
-                        la32r_exccode exc = mmu.va_write(va, 2, (char * ) & GPR[instr._2ri12.rd],
+                        la32r_exccode exc = mmu.va_write(va, (uint16_t)GPR[instr._2ri12.rd],
                                                          csr.get_cur_plv(),
                                                          csr.get_crmd_pg(),
                                                          csr.get_asid());
@@ -294,7 +308,7 @@ private:
                     }
                     case ST_W: {
                         uint32_t va = GPR[instr._2ri12.rj] + instr._2ri12.i12;
-                        la32r_exccode exc = mmu.va_write(va, 4, (char * ) & GPR[instr._2ri12.rd],
+                        la32r_exccode exc = mmu.va_write(va, (uint32_t)GPR[instr._2ri12.rd],
                                                          csr.get_cur_plv(),
                                                          csr.get_crmd_pg(),
                                                          csr.get_asid());
@@ -306,7 +320,7 @@ private:
                     case LD_BU: {
                         uint32_t va = GPR[instr._2ri12.rj] + instr._2ri12.i12;
                         uint8_t temp;
-                        la32r_exccode exc = mmu.va_read(va, 1, (char * ) & temp,
+                        la32r_exccode exc = mmu.va_read(va, temp,
                                                         csr.get_cur_plv(),
                                                         csr.get_crmd_pg(),
                                                         csr.get_asid());
@@ -320,7 +334,7 @@ private:
                     case LD_HU: {
                         uint32_t va = GPR[instr._2ri12.rj] + instr._2ri12.i12;
                         uint16_t temp;
-                        la32r_exccode exc = mmu.va_read(va, 2, (char * ) & temp,
+                        la32r_exccode exc = mmu.va_read(va, temp,
                                                         csr.get_cur_plv(),
                                                         csr.get_crmd_pg(),
                                                         csr.get_asid());
@@ -443,14 +457,14 @@ private:
                                 if (instr._2r.rd == 0) { // RDCNTID
                                     set_GPR(instr._2r.rj, csr.get_timer_id());
                                 } else if (instr._2r.rj == 0) { // RDCNTVL.W
-                                    set_GPR(instr._2r.rd, counter & 0xffffffffu);
+                                    set_GPR(instr._2r.rd, (events.now() - counter_base) & 0xffffffffu);
                                 } else {
                                     // la32r only has RDCNTVL.W & RDCNTVH.W & RDCNTID
                                 }
                                 break;
                             case RDTIMEH_W:
                                 if (instr._2r.rj == 0) { // RDCNTVH.W
-                                    set_GPR(instr._2r.rd, counter >> 32);
+                                    set_GPR(instr._2r.rd, (events.now() - counter_base) >> 32);
                                 } else {
                                     // la32r only has RDCNTVL.W & RDCNTVH.W & RDCNTID
                                 }
@@ -523,11 +537,12 @@ private:
     std::queue <uint32_t> pc_trace;
 
     bool idle;
-    uint64_t counter;
+    event_queue &events;
+    uint64_t counter_base; // the stable counter runs on the shared virtual time
     uint32_t pc;
     int32_t GPR[32];
-    la32r_mmu<nr_tlb_entry> mmu;
-    la32r_csr<nr_tlb_entry> csr;
+    la32r_mmu<nr_tlb_entry, bus_t> mmu;
+    la32r_csr<nr_tlb_entry, bus_t> csr;
 };
 
 #endif // LA32R_CORE
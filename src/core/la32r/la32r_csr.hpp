@@ -2,11 +2,13 @@
 #define LA32R_CSR
 
 #include "la32r_mmu.hpp"
+#include "event_queue.hpp"
 
-template<int nr_tlb_entry = 32>
+template<int nr_tlb_entry = 32, typename bus_t = memory_bus>
 class la32r_csr {
 public:
-    la32r_csr(uint32_t core_id, uint32_t &pc, la32r_mmu<nr_tlb_entry> &mmu) : core_id(core_id), pc(pc), mmu(mmu) {
+    la32r_csr(uint32_t core_id, uint32_t &pc, la32r_mmu<nr_tlb_entry, bus_t> &mmu, event_queue &events) : core_id(core_id), pc(pc), mmu(mmu), events(events) {
+        timer_id = events.add_timer([this]() { timer_fire(); });
         reset();
     }
 
@@ -47,6 +49,7 @@ public:
         cur_need_trap = false;
         trap_pc = 0;
         timer_en = false;
+        events.cancel(timer_id);
     }
 
     uint32_t read(uint32_t index) {
@@ -98,7 +101,7 @@ public:
         case TCFG:
             return tcfg;
         case TVAL:
-            return tval;
+            return get_tval();
         case TICLR:
             return 0;
         case LLBCTL:
@@ -228,6 +231,12 @@ public:
             old_val->init_val = new_val->init_val;
             tval = new_val->init_val << 2;
             timer_en = new_val->en == 1;
+            if (timer_en) {
+                timer_deadline = events.now() + tval + 1llu;
+                events.schedule(timer_id, timer_deadline);
+            } else {
+                events.cancel(timer_id);
+            }
             break;
         }
         case TICLR: {
@@ -277,22 +286,8 @@ public:
 
     void pre_exec(unsigned int ext_int) {
         cur_need_trap = false;
-        auto tcfg_reg = (csr_tcfg *) &tcfg;
         auto estat_reg = (csr_estat *) &estat;
         auto ecfg_reg = (csr_ecfg *) &ecfg;
-        if (timer_en) {
-            if (tval == 0) {
-                ((csr_estat *) &estat)->is |= (1 << 11);
-                timer_en = tcfg_reg->periodic;
-                if (tcfg_reg->periodic) {
-                    tval = tcfg_reg->init_val << 2;
-                } else {
-                    tval = 0xffffffffu;
-                }
-            } else {
-                tval -= 1;
-            }
-        }
         random = (random == 0) ? (nr_tlb_entry - 1) : (random - 1);
         estat_reg->is = (estat_reg->is & 0b1100000000011u) | ((ext_int & 0b111111111u) << 2);
         if ((estat_reg->is & ecfg_reg->lie) != 0 && ((csr_crmd *) &crmd)->ie != 0) {
@@ -507,6 +502,24 @@ public:
         }
     }
 
+    // Timer deadlines are on the shared time, restored before us by the machine.
+    void serialize(checkpoint &cp) {
+        cp.section("la32r_csr");
+        cp.io(random);
+        cp.io(cur_need_trap);
+        cp.io(trap_pc);
+        cp.io(timer_en);
+        cp.io(timer_deadline);
+        uint32_t *regs[] = {&crmd, &prmd, &euen, &ecfg, &estat, &era, &badv, &eentry, &tlbidx, &tlbehi,
+                            &tlbelo0, &tlbelo1, &asid, &pgdl, &pgdh, &cpuid, &save0, &save1, &save2, &save3,
+                            &tid, &tcfg, &tval, &llbctl, &tlbrentry, &ctag, &dmw0, &dmw1};
+        for (uint32_t *reg : regs) cp.io(*reg);
+        if (!cp.saving()) {
+            if (timer_en) events.schedule(timer_id, timer_deadline);
+            else events.cancel(timer_id);
+        }
+    }
+
 private:
     uint32_t *save_of(uint32_t index) {
         if (index == SAVE0) return &save0;
@@ -516,15 +529,40 @@ private:
         return nullptr;
     }
 
+    // While enabled, tval is derived from the shared virtual time and counts down one per tick.
+    uint32_t get_tval() {
+        return timer_en ? timer_deadline - events.now() - 1 : tval;
+    }
+
+    // Raise the timer interrupt, then reload the timer if periodic.
+    void timer_fire() {
+        auto tcfg_reg = (csr_tcfg *) &tcfg;
+        ((csr_estat *) &estat)->is |= (1 << 11);
+        timer_en = tcfg_reg->periodic;
+        if (!timer_en) {
+            tval = 0xffffffffu;
+            return;
+        }
+        uint64_t period = ((uint32_t) tcfg_reg->init_val << 2) + 1llu;
+        timer_deadline += period;
+        if (timer_deadline <= events.now()) {
+            timer_deadline += (events.now() - timer_deadline) / period * period + period;
+        }
+        events.schedule(timer_id, timer_deadline);
+    }
+
     uint32_t core_id;
 
-    la32r_mmu<nr_tlb_entry> &mmu;
+    la32r_mmu<nr_tlb_entry, bus_t> &mmu;
+    event_queue &events;
     uint32_t &pc;
 
     uint32_t random;
     bool cur_need_trap;
     uint32_t trap_pc;
     bool timer_en;
+    int timer_id;
+    uint64_t timer_deadline;
 
     uint32_t crmd;
     uint32_t prmd;
@@ -3,6 +3,7 @@
 
 #include "../../memory/memory_bus.hpp"
 #include "la32r_common.hpp"
+#include "checkpoint.hpp"
 
 #include <cassert>
 #include <cstdint>
@@ -18,10 +19,10 @@
         } \
     })
 
-template<int nr_tlb_entry = 32>
+template<int nr_tlb_entry = 32, typename bus_t = memory_bus>
 class la32r_mmu {
 public:
-    la32r_mmu(memory_bus &bus) : bus(bus) {
+    la32r_mmu(bus_t &bus) : bus(bus) {
         reset();
     }
 
@@ -61,17 +62,18 @@ public:
         return std::make_pair(OK, 0);
     }
 
-    la32r_exccode va_read(uint32_t addr, uint32_t size, char *buffer, la32r_plv cur_plv, bool map, uint32_t asid) {
-        if (addr % size != 0) {
+    template <typename T>
+    la32r_exccode va_read(uint32_t addr, T &value, la32r_plv cur_plv, bool map, uint32_t asid) {
+        if (addr % sizeof(T) != 0) {
             return std::make_pair(ALE, 0);
         }
         if (!map) {
-            bus_assert(bus.do_read(addr, size, buffer));
+            bus_assert(bus.read(addr, value));
             return std::make_pair(OK, 0);
         }
         auto dmwe = dmw_match(addr, cur_plv);
         if (dmwe != nullptr) {
-            bus_assert(bus.do_read((dmwe->pseg << 29) | (addr & 0x1fffffffu), size, buffer));
+            bus_assert(bus.read((dmwe->pseg << 29) | (addr & 0x1fffffffu), value));
             return std::make_pair(OK, 0);
         }
         if (cur_plv == plv3 && addr >= 0x80000000u) {
@@ -88,21 +90,22 @@ public:
         if (cur_plv > plv) {
             return std::make_pair(PPI, 0);
         }
-        bus_assert(bus.do_read(pa, size, buffer));
+        bus_assert(bus.read(pa, value));
         return std::make_pair(OK, 0);
     }
 
-    la32r_exccode va_write(uint32_t addr, uint32_t size, char *buffer, la32r_plv cur_plv, bool map, uint32_t asid) {
-        if (addr % size != 0) {
+    template <typename T>
+    la32r_exccode va_write(uint32_t addr, T value, la32r_plv cur_plv, bool map, uint32_t asid) {
+        if (addr % sizeof(T) != 0) {
             return std::make_pair(ALE, 0);
         }
         if (!map) {
-            bus_assert(bus.do_write(addr, size, buffer));
+            bus_assert(bus.write(addr, value));
             return std::make_pair(OK, 0);
         }
         auto dmwe = dmw_match(addr, cur_plv);
         if (dmwe != nullptr) {
-            bus_assert(bus.do_write((dmwe->pseg << 29) | (addr & 0x1fffffffu), size, buffer));
+            bus_assert(bus.write((dmwe->pseg << 29) | (addr & 0x1fffffffu), value));
             return std::make_pair(OK, 0);
         }
         if (cur_plv == plv3 && addr >= 0x80000000u) {
@@ -122,7 +125,7 @@ public:
         if (!dirty) {
             return std::make_pair(PME, 0);
         }
-        bus_assert(bus.do_write(pa, size, buffer));
+        bus_assert(bus.write(pa, value));
         return std::make_pair(OK, 0);
     }
 
@@ -157,6 +160,11 @@ public:
         dmw[index] = dmwe;
     }
 
+    void serialize(checkpoint &cp) {
+        cp.io(tlb);
+        cp.io(dmw);
+    }
+
 private:
     bool page_trans(uint32_t va, uint32_t asid,
                     bool &dirty, bool &to_refill, uint32_t &pa, la32r_mat &mat, la32r_plv &plv) {
@@ -204,7 +212,7 @@ private:
         return nullptr;
     }
 
-    memory_bus &bus;
+    bus_t &bus;
     la32r_tlb tlb[nr_tlb_entry];
     la32r_dmw dmw[2];
 };
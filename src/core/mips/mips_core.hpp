@@ -10,10 +10,10 @@
 #include <queue>
 #include <set>
 
-template <int nr_tlb_entry = 8>
+template <int nr_tlb_entry = 8, typename bus_t = memory_bus>
 class mips_core {
 public:
-    mips_core(memory_bus &bus):mmu(bus),cp0(pc,in_delay_slot,mmu) {
+    mips_core(bus_t &bus, event_queue &events):mmu(bus),cp0(pc,in_delay_slot,mmu,events) {
         reset();
     }
     void step(uint8_t ext_int = 0) {
@@ -37,6 +37,7 @@ public:
         in_delay_slot = false;
         next_control_trans = false;
         cur_control_trans = false;
+        wait = false;
         cp0.reset();
         mmu.reset();
         debug_wb_pc = 0;
@@ -55,6 +56,9 @@ public:
     uint32_t get_pc() {
         return pc;
     }
+    bool is_idle() {
+        return wait;
+    }
     void set_difftest_mode(bool value) {
         difftest_mode = value;
     }
@@ -78,6 +82,22 @@ public:
     std::queue <uint32_t> pc_trace;
     std::set <uint32_t> cache_op;
     // TODO: trace with exceptions (add exception signal at commit stage is need)
+    void serialize(checkpoint &cp) {
+        cp.section("mips_core");
+        cp.io(pc);
+        cp.io(wait);
+        cp.io(next_delay_slot);
+        cp.io(in_delay_slot);
+        cp.io(next_control_trans);
+        cp.io(cur_control_trans);
+        cp.io(delay_npc);
+        cp.io(GPR);
+        cp.io(hi);
+        cp.io(lo);
+        cp.io(insret);
+        mmu.serialize(cp);
+        cp0.serialize(cp);
+    }
 private:
     void exec(uint8_t ext_int) {
         in_delay_slot = next_delay_slot;
@@ -96,8 +116,15 @@ private:
         pc_trace.push(pc);
         if (!difftest_mode) cp0.pre_exec(ext_int);
         else if (int_allow) cp0.check_and_raise_int();
-        if (cp0.need_trap()) goto ctrl_trans_and_exception;
+        if (cp0.need_trap()) {
+            wait = false;
+            goto ctrl_trans_and_exception;
+        }
         while (pc_trace.size() > 16) pc_trace.pop();
+        if (wait) {
+            if (!cp0.int_pending()) return;
+            wait = false;
+        }
         if_exc = mmu.va_if(pc, (char*)&instr, cp0.get_ksu(), cp0.get_asid(), tlb_invalid);
         if (if_exc != EXC_OK) {
             cp0.raise_trap(if_exc, pc, tlb_invalid);
@@ -691,7 +718,7 @@ private:
                 // LB
                 uint32_t vaddr = GPR[instr.i_type.rs] + instr.i_type.imm;
                 int8_t buf;
-                mips32_exccode stat = mmu.va_read(vaddr, 1, (char*)&buf, cp0.get_ksu(), cp0.get_asid(), tlb_invalid);
+                mips32_exccode stat = mmu.va_read(vaddr, buf, cp0.get_ksu(), cp0.get_asid(), tlb_invalid);
                 if (stat != EXC_OK) cp0.raise_trap(stat, vaddr, tlb_invalid);
                 else set_GPR(instr.i_type.rt, buf);
                 break;
@@ -700,7 +727,7 @@ private:
                 // LBU
                 uint32_t vaddr = GPR[instr.i_type.rs] + instr.i_type.imm;
                 uint8_t buf;
-                mips32_exccode stat = mmu.va_read(vaddr, 1, (char*)&buf, cp0.get_ksu(), cp0.get_asid(), tlb_invalid);
+                mips32_exccode stat = mmu.va_read(vaddr, buf, cp0.get_ksu(), cp0.get_asid(), tlb_invalid);
                 if (stat != EXC_OK) cp0.raise_trap(stat, vaddr, tlb_invalid);
                 else set_GPR(instr.i_type.rt, buf);
                 break;
@@ -709,7 +736,7 @@ private:
                 // LH
                 uint32_t vaddr = GPR[instr.i_type.rs] + instr.i_type.imm;
                 int16_t buf;
-                mips32_exccode stat = mmu.va_read(vaddr, 2, (char*)&buf, cp0.get_ksu(), cp0.get_asid(), tlb_invalid);
+                mips32_exccode stat = mmu.va_read(vaddr, buf, cp0.get_ksu(), cp0.get_asid(), tlb_invalid);
                 if (stat != EXC_OK) cp0.raise_trap(stat, vaddr, tlb_invalid);
                 else set_GPR(instr.i_type.rt, buf);
                 break;
@@ -718,7 +745,7 @@ private:
                 // LHU
                 uint32_t vaddr = GPR[instr.i_type.rs] + instr.i_type.imm;
                 uint16_t buf;
-                mips32_exccode stat = mmu.va_read(vaddr, 2, (char*)&buf, cp0.get_ksu(), cp0.get_asid(), tlb_invalid);
+                mips32_exccode stat = mmu.va_read(vaddr, buf, cp0.get_ksu(), cp0.get_asid(), tlb_invalid);
                 if (stat != EXC_OK) cp0.raise_trap(stat, vaddr, tlb_invalid);
                 else set_GPR(instr.i_type.rt, buf);
                 break;
@@ -728,7 +755,7 @@ private:
                 uint32_t vaddr = GPR[instr.i_type.rs] + instr.i_type.imm;
                 uint32_t buf;
                 if (vaddr == 0xbfafe000u) debug_wb_is_timer = true; // for difftest
-                mips32_exccode stat = mmu.va_read(vaddr, 4, (char*)&buf, cp0.get_ksu(), cp0.get_asid(), tlb_invalid);
+                mips32_exccode stat = mmu.va_read(vaddr, buf, cp0.get_ksu(), cp0.get_asid(), tlb_invalid);
                 if (stat != EXC_OK) cp0.raise_trap(stat, vaddr, tlb_invalid);
                 else set_GPR(instr.i_type.rt, buf);
                 break;
@@ -737,7 +764,7 @@ private:
                 // LWL
                 uint32_t vaddr = GPR[instr.i_type.rs] + instr.i_type.imm;
                 uint32_t buf;
-                mips32_exccode stat = mmu.va_read(vaddr ^ (vaddr & 3), 4, (char*)&buf, cp0.get_ksu(), cp0.get_asid(), tlb_invalid);
+                mips32_exccode stat = mmu.va_read(vaddr ^ (vaddr & 3), buf, cp0.get_ksu(), cp0.get_asid(), tlb_invalid);
                 if (stat != EXC_OK) cp0.raise_trap(stat, vaddr, tlb_invalid);
                 else {
                     switch (vaddr % 4) {
@@ -764,7 +791,7 @@ private:
             case OPCODE_LWR: {
                 uint32_t vaddr = GPR[instr.i_type.rs] + instr.i_type.imm;
                 uint32_t buf;
-                mips32_exccode stat = mmu.va_read(vaddr ^ (vaddr & 3), 4, (char*)&buf, cp0.get_ksu(), cp0.get_asid(), tlb_invalid);
+                mips32_exccode stat = mmu.va_read(vaddr ^ (vaddr & 3), buf, cp0.get_ksu(), cp0.get_asid(), tlb_invalid);
                 if (stat != EXC_OK) cp0.raise_trap(stat, vaddr, tlb_invalid);
                 else {
                     switch (vaddr % 4) {
@@ -791,21 +818,21 @@ private:
             case OPCODE_SB: {
                 // SB
                 uint32_t vaddr = GPR[instr.i_type.rs] + instr.i_type.imm;
-                mips32_exccode stat = mmu.va_write(vaddr, 1, (char*)&GPR[instr.i_type.rt], cp0.get_ksu(), cp0.get_asid(), tlb_invalid);
+                mips32_exccode stat = mmu.va_write(vaddr, (uint8_t)GPR[instr.i_type.rt], cp0.get_ksu(), cp0.get_asid(), tlb_invalid);
                 if (stat != EXC_OK) cp0.raise_trap(stat, vaddr, tlb_invalid);
                 break;
             }
             case OPCODE_SH: {
                 // SH
                 uint32_t vaddr = GPR[instr.i_type.rs] + instr.i_type.imm;
-                mips32_exccode stat = mmu.va_write(vaddr, 2, (char*)&GPR[instr.i_type.rt], cp0.get_ksu(), cp0.get_asid(), tlb_invalid);
+                mips32_exccode stat = mmu.va_write(vaddr, (uint16_t)GPR[instr.i_type.rt], cp0.get_ksu(), cp0.get_asid(), tlb_invalid);
                 if (stat != EXC_OK) cp0.raise_trap(stat, vaddr, tlb_invalid);
                 break;
             }
             case OPCODE_SW: {
                 // SW
                 uint32_t vaddr = GPR[instr.i_type.rs] + instr.i_type.imm;
-                mips32_exccode stat = mmu.va_write(vaddr, 4, (char*)&GPR[instr.i_type.rt], cp0.get_ksu(), cp0.get_asid(), tlb_invalid);
+                mips32_exccode stat = mmu.va_write(vaddr, (uint32_t)GPR[instr.i_type.rt], cp0.get_ksu(), cp0.get_asid(), tlb_invalid);
                 if (stat != EXC_OK) cp0.raise_trap(stat, vaddr, tlb_invalid);
                 break;
             }
@@ -813,7 +840,7 @@ private:
                 // SWL
                 uint32_t vaddr = GPR[instr.i_type.rs] + instr.i_type.imm;
                 uint32_t buf;
-                mips32_exccode stat = mmu.va_read(vaddr ^ (vaddr & 3), 4, (char*)&buf, cp0.get_ksu(), cp0.get_asid(), tlb_invalid);
+                mips32_exccode stat = mmu.va_read(vaddr ^ (vaddr & 3), buf, cp0.get_ksu(), cp0.get_asid(), tlb_invalid);
                 if (stat != EXC_OK) {
                     if (stat == EXC_TLBL) stat = EXC_TLBS;
                     cp0.raise_trap(stat, vaddr, tlb_invalid);
@@ -835,7 +862,7 @@ private:
                         default:
                             assert(false);
                     }
-                    stat = mmu.va_write(vaddr ^ (vaddr & 3), 4, (char*)&buf, cp0.get_ksu(), cp0.get_asid(), tlb_invalid);
+                    stat = mmu.va_write(vaddr ^ (vaddr & 3), buf, cp0.get_ksu(), cp0.get_asid(), tlb_invalid);
                     if (stat != EXC_OK) cp0.raise_trap(stat, vaddr, tlb_invalid);
                 }
                 break;
@@ -844,7 +871,7 @@ private:
                 // SWR
                 uint32_t vaddr = GPR[instr.i_type.rs] + instr.i_type.imm;
                 uint32_t buf;
-                mips32_exccode stat = mmu.va_read(vaddr ^ (vaddr & 3), 4, (char*)&buf, cp0.get_ksu(), cp0.get_asid(), tlb_invalid);
+                mips32_exccode stat = mmu.va_read(vaddr ^ (vaddr & 3), buf, cp0.get_ksu(), cp0.get_asid(), tlb_invalid);
                 if (stat != EXC_OK) {
                     if (stat == EXC_TLBL) stat = EXC_TLBS;
                     cp0.raise_trap(stat, vaddr, tlb_invalid);
@@ -866,7 +893,7 @@ private:
                         default:
                             assert(false);
                     }
-                    stat = mmu.va_write(vaddr ^ (vaddr & 3), 4, (char*)&buf, cp0.get_ksu(), cp0.get_asid(), tlb_invalid);
+                    stat = mmu.va_write(vaddr ^ (vaddr & 3), buf, cp0.get_ksu(), cp0.get_asid(), tlb_invalid);
                     if (stat != EXC_OK) cp0.raise_trap(stat, vaddr, tlb_invalid);
                 }
                 break;
@@ -904,6 +931,7 @@ private:
                                     cp0.tlbwr();
                                     break;
                                 case FUNCT_WAIT:
+                                    wait = !difftest_mode;
                                     break;
                                 default:
                                     assert(false);
@@ -936,7 +964,7 @@ private:
                 uint32_t vaddr = GPR[instr.i_type.rs] + instr.i_type.imm;
                 uint32_t buf;
                 if (vaddr == 0xbfafe000u) debug_wb_is_timer = true; // for difftest
-                mips32_exccode stat = mmu.va_read(vaddr, 4, (char*)&buf, cp0.get_ksu(), cp0.get_asid(), tlb_invalid);
+                mips32_exccode stat = mmu.va_read(vaddr, buf, cp0.get_ksu(), cp0.get_asid(), tlb_invalid);
                 if (stat != EXC_OK) cp0.raise_trap(stat, vaddr, tlb_invalid);
                 else set_GPR(instr.i_type.rt, buf);
                 break;
@@ -944,7 +972,7 @@ private:
             case OPCODE_SC: {
                 // LL as SW but set GPR[rt] to 1
                 uint32_t vaddr = GPR[instr.i_type.rs] + instr.i_type.imm;
-                mips32_exccode stat = mmu.va_write(vaddr, 4, (char*)&GPR[instr.i_type.rt], cp0.get_ksu(), cp0.get_asid(), tlb_invalid);
+                mips32_exccode stat = mmu.va_write(vaddr, (uint32_t)GPR[instr.i_type.rt], cp0.get_ksu(), cp0.get_asid(), tlb_invalid);
                 if (stat != EXC_OK) cp0.raise_trap(stat, vaddr, tlb_invalid);
                 else set_GPR(instr.i_type.rt, 1);
                 break;
@@ -978,6 +1006,7 @@ private:
         }
     }
     uint32_t pc;    
+    bool wait;
     bool next_delay_slot = false;
     bool in_delay_slot = false;
     bool next_control_trans = false;
@@ -985,8 +1014,8 @@ private:
     uint32_t delay_npc;
     int32_t GPR[32];
     uint32_t hi,lo;
-    mips_mmu<nr_tlb_entry> mmu;
-    mips_cp0<nr_tlb_entry> cp0;
+    mips_mmu<nr_tlb_entry, bus_t> mmu;
+    mips_cp0<nr_tlb_entry, bus_t> cp0;
 };
 
 
@@ -3,21 +3,23 @@
 
 #include "mips_common.hpp"
 #include "mips_mmu.hpp"
+#include "event_queue.hpp"
 #include <cstdint>
 #include <cassert>
 #include <cstdio>
 
 // TODO: Trap on CP0 unuseable (User Mode and !CU[0])
 
-template <int nr_tlb_entry = 8>
+template <int nr_tlb_entry = 8, typename bus_t = memory_bus>
 class mips_cp0 {
 public:
-    mips_cp0(uint32_t &pc, bool &bd, mips_mmu<nr_tlb_entry> &mmu):pc(pc),bd(bd),mmu(mmu) {
+    mips_cp0(uint32_t &pc, bool &bd, mips_mmu<nr_tlb_entry, bus_t> &mmu, event_queue &events):pc(pc),bd(bd),mmu(mmu),events(events) {
+        timer_id = events.add_timer([this]() { timer_fire(); });
         reset();
     }
     void difftest_preexec(uint32_t cp0_count_val, uint32_t cp0_random_val, uint32_t cp0_cause_val, bool interrupt_on) {
         cur_need_trap = false;
-        count = cp0_count_val;
+        set_count(cp0_count_val);
         random = cp0_random_val;
         cp0_cause *cause_reg = (cp0_cause*)&cause;
         cp0_cause *cause_reg_diff = (cp0_cause*)&cp0_cause_val;
@@ -32,9 +34,10 @@ public:
         pagemask = 0;
         wired = 0;
         badva = 0;
-        count = 0;
         entryhi = 0;
         compare = 0;
+        timer_deadline = 0;
+        set_count(0);
         status = 0;
         cp0_status *status_reg = (cp0_status*)&status;
         status_reg->BEV = 1;
@@ -89,7 +92,7 @@ public:
                 return badva;
             case RD_COUNT:
                 assert(sel == 0);
-                return count;
+                return get_count();
             case RD_ENTRYHI:
                 assert(sel == 0);
                 return entryhi;
@@ -190,7 +193,7 @@ public:
                 break;
             }
             case RD_COUNT:
-                count = value;
+                set_count(value);
                 assert(sel == 0);
                 break;
             case RD_ENTRYHI: {
@@ -204,6 +207,7 @@ public:
                 compare = value;
                 cp0_cause *cause_reg = (cp0_cause*)&cause;
                 cause_reg->IP &= 0x7f; // clear IP[7s]
+                update_timer();
                 assert(sel == 0);
                 break;
             }
@@ -264,16 +268,20 @@ public:
     }
     void pre_exec(unsigned int ext_int) {
         cur_need_trap = false;
-        count = (count + 1llu) &0xfffffffflu;
         random = random == wired ? (nr_tlb_entry - 1) : random - 1;
         cp0_cause *cause_reg = (cp0_cause*)&cause;
         cause_reg->IP = (cause_reg->IP & 0b10000011u) | ( (ext_int & 0b11111u) << 2);
-        if (count == compare) cause_reg->IP |= 1u << 7;
         check_and_raise_int();
     }
     bool need_trap() {
         return cur_need_trap;
     }
+    // WAIT resumes on any interrupt unmasked by IM, even if IE is clear.
+    bool int_pending() {
+        cp0_status *status_reg = (cp0_status*)&status;
+        cp0_cause *cause_reg = (cp0_cause*)&cause;
+        return (status_reg->IM & cause_reg->IP) != 0;
+    }
     uint32_t get_trap_pc() {
         return trap_pc;
     }
@@ -397,13 +405,68 @@ public:
             raise_trap(EXC_INT);
         }
     }
+    // Count is kept as count_base on the shared time, restored before us by the machine.
+    void serialize(checkpoint &cp) {
+        cp.section("mips_cp0");
+        cp.io(cur_need_trap);
+        cp.io(trap_pc);
+        cp.io(timer_deadline);
+        cp.io(count_base);
+        cp.io(index);
+        cp.io(random);
+        cp.io(entrylo0);
+        cp.io(entrylo1);
+        cp.io(context);
+        cp.io(pagemask);
+        cp.io(wired);
+        cp.io(badva);
+        cp.io(entryhi);
+        cp.io(compare);
+        cp.io(status);
+        cp.io(cause);
+        cp.io(epc);
+        cp.io(prid);
+        cp.io(ebase);
+        cp.io(config0);
+        cp.io(config1);
+        cp.io(taglo);
+        cp.io(taghi);
+        cp.io(errorepc);
+        if (!cp.saving()) events.schedule(timer_id, timer_deadline);
+    }
 private:
-    mips_mmu<nr_tlb_entry> &mmu;
+    // Count runs on the shared virtual time, one tick per instruction unless the machine follows the host clock.
+    uint32_t get_count() {
+        return events.now() - count_base;
+    }
+    void set_count(uint32_t value) {
+        count_base = events.now() - value;
+        update_timer();
+    }
+    // Schedule the next time Count reaches Compare, a full wrap away if they are equal now.
+    void update_timer() {
+        uint64_t dist = static_cast<uint32_t>(compare - get_count());
+        if (dist == 0) dist = 1ull << 32;
+        if (events.now() + dist == timer_deadline) return;
+        timer_deadline = events.now() + dist;
+        events.schedule(timer_id, timer_deadline);
+    }
+    void timer_fire() {
+        cp0_cause *cause_reg = (cp0_cause*)&cause;
+        cause_reg->IP |= 1u << 7;
+        timer_deadline += 1ull << 32;
+        events.schedule(timer_id, timer_deadline);
+    }
+    mips_mmu<nr_tlb_entry, bus_t> &mmu;
+    event_queue &events;
 
     uint32_t &pc;
     bool &bd;
 
     uint32_t trap_pc;
+    int timer_id;
+    uint64_t timer_deadline;
+    uint64_t count_base;
     
     uint32_t index; // Note: index[31] will be write by TLBP
     uint32_t random;
@@ -413,7 +476,6 @@ private:
     uint32_t pagemask;
     uint32_t wired;
     uint32_t badva;
-    uint32_t count;
     uint32_t entryhi; // entryhi VPN2 will be updated by TLB exception and TLBR
     // entryhi ASID will be updated by TLBR
     uint32_t compare;
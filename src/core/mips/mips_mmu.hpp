@@ -3,12 +3,13 @@
 
 #include "memory_bus.hpp"
 #include "mips_common.hpp"
+#include "checkpoint.hpp"
 #include <cstdint>
 
-template <int nr_tlb_entry = 8>
+template <int nr_tlb_entry = 8, typename bus_t = memory_bus>
 class mips_mmu {
 public:
-    mips_mmu(memory_bus &bus):bus(bus) {
+    mips_mmu(bus_t &bus):bus(bus) {
         reset();
     }
     void reset() {
@@ -34,10 +35,11 @@ public:
             }
         }
     }
-    // size should be 1, 2, 4
-    mips32_exccode va_read(uint32_t addr, uint32_t size, char *buffer, mips32_ksu mode, uint8_t asid, bool &tlb_invalid) {
+    // T should be 1, 2 or 4 bytes
+    template <typename T>
+    mips32_exccode va_read(uint32_t addr, T &value, mips32_ksu mode, uint8_t asid, bool &tlb_invalid) {
         tlb_invalid = false;
-        if ((mode == USER_MODE && addr >= 0x80000000u) || addr % size != 0) return EXC_ADEL;
+        if ((mode == USER_MODE && addr >= 0x80000000u) || addr % sizeof(T) != 0) return EXC_ADEL;
         else {
             bool dirty;
             bool to_refill;
@@ -48,14 +50,15 @@ public:
                 return EXC_TLBL;
             }
             else {
-                if (!bus.do_read(pa, size, buffer)) return EXC_DBE;
+                if (!bus.read(pa, value)) return EXC_DBE;
                 else return EXC_OK;
             }
         }
     }
-    mips32_exccode va_write(uint32_t addr, uint32_t size, const char *buffer, mips32_ksu mode, uint8_t asid, bool &tlb_invalid) {
+    template <typename T>
+    mips32_exccode va_write(uint32_t addr, T value, mips32_ksu mode, uint8_t asid, bool &tlb_invalid) {
         tlb_invalid = false;
-        if ((mode == USER_MODE && addr >= 0x80000000u) || addr % size != 0) return EXC_ADES;
+        if ((mode == USER_MODE && addr >= 0x80000000u) || addr % sizeof(T) != 0) return EXC_ADES;
         else {
             bool dirty;
             bool to_refill;
@@ -67,7 +70,7 @@ public:
             }
             else {
                 if (!dirty) return EXC_MOD;
-                if (!bus.do_write(pa, size, buffer)) return EXC_DBE;
+                if (!bus.write(pa, value)) return EXC_DBE;
                 else return EXC_OK;
             }
         }
@@ -86,6 +89,9 @@ public:
         assert(idx < nr_tlb_entry);
         tlb[idx] = tlb_entry;
     }
+    void serialize(checkpoint &cp) {
+        cp.io(tlb);
+    }
 private:
     // don't care CCA
     bool translation(uint32_t va, uint8_t asid, bool &dirty, bool &to_refill, uint32_t &pa) {
@@ -129,7 +135,7 @@ private:
         }
         return NULL;
     }
-    memory_bus &bus;
+    bus_t &bus;
     mips_tlb tlb[nr_tlb_entry];
 };
 
@@ -7,6 +7,8 @@
 #include "rv_systembus.hpp"
 #include "rv_priv.hpp"
 #include <deque>
+#include <queue>
+#include <climits>
 
 extern bool riscv_test;
 
@@ -20,9 +22,11 @@ enum alu_op {
 
 #define PC_ALIGN 2
 
+// bus_t is rv_systembus or a basic_rv_systembus over a static_map.
+template <typename bus_t = rv_systembus>
 class rv_core {
 public:
-    rv_core(rv_systembus &systembus, uint8_t hart_id = 0):systembus(systembus),priv(hart_id,pc,systembus) {
+    rv_core(bus_t &systembus, uint8_t hart_id = 0):systembus(systembus),priv(hart_id,pc,systembus) {
         for (int i=0;i<32;i++) GPR[i] = 0;
     }
     void step(bool meip, bool msip, bool mtip, bool seip) {
@@ -38,12 +42,28 @@ public:
     uint64_t getPC() {
         return pc;
     }
+    // A hart is idle after WFI until any interrupt enabled in mie becomes pending.
+    bool is_idle() {
+        return wfi;
+    }
+    // Account for cycles that passed while the hart was idle and not stepped.
+    void advance(uint64_t ticks) {
+        priv.advance_cycle(ticks);
+    }
+    void serialize(checkpoint &cp) {
+        cp.section("rv_core");
+        cp.io(pc);
+        cp.io(GPR);
+        cp.io(wfi);
+        priv.serialize(cp);
+    }
 private:
+    bool wfi = false;
     uint32_t trace_size = riscv_test ? 128 : 0;
     std::queue <uint64_t> trace;
-    rv_systembus &systembus;
+    bus_t &systembus;
     uint64_t pc = 0;
-    rv_priv priv;
+    rv_priv<bus_t> priv;
     int64_t GPR[32];
     void exec(bool meip, bool msip, bool mtip, bool seip) {
         if (riscv_test && priv.get_cycle() >= 1000000) {
@@ -63,7 +83,14 @@ private:
         rv_exc_code if_exc;
     instr_fetch:
         priv.pre_exec(meip,msip,mtip,seip);
-        if (priv.need_trap()) goto exception;
+        if (priv.need_trap()) {
+            wfi = false;
+            goto exception;
+        }
+        if (wfi) {
+            if (!priv.int_pending()) return;
+            wfi = false;
+        }
         if (pc % PC_ALIGN) {
             priv.raise_trap(csr_cause_def(exc_instr_misalign),pc);
             goto exception;
@@ -159,43 +186,43 @@ private:
                 switch (inst->i_type.funct3) {
                     case FUNCT3_LB: {
                         int8_t buf;
-                        bool ok = mem_read(mem_addr,1,(char*)&buf);
+                        bool ok = mem_read(mem_addr,buf);
                         if (ok) set_GPR(inst->i_type.rd,buf);
                         break;
                     }
                     case FUNCT3_LH: {
                         int16_t buf;
-                        bool ok = mem_read(mem_addr,2,(char*)&buf);
+                        bool ok = mem_read(mem_addr,buf);
                         if (ok) set_GPR(inst->i_type.rd,buf);
                         break;
                     }
                     case FUNCT3_LW: {
                         int32_t buf;
-                        bool ok = mem_read(mem_addr,4,(char*)&buf);
+                        bool ok = mem_read(mem_addr,buf);
                         if (ok) set_GPR(inst->i_type.rd,buf);
                         break;
                     }
                     case FUNCT3_LD: {
                         int64_t buf;
-                        bool ok = mem_read(mem_addr,8,(char*)&buf);
+                        bool ok = mem_read(mem_addr,buf);
                         if (ok) set_GPR(inst->i_type.rd,buf);
                         break;
                     }
                     case FUNCT3_LBU: {
                         uint8_t buf;
-                        bool ok = mem_read(mem_addr,1,(char*)&buf);
+                        bool ok = mem_read(mem_addr,buf);
                         if (ok) set_GPR(inst->i_type.rd,buf);
                         break;
                     }
                     case FUNCT3_LHU: {
                         uint16_t buf;
-                        bool ok = mem_read(mem_addr,2,(char*)&buf);
+                        bool ok = mem_read(mem_addr,buf);
                         if (ok) set_GPR(inst->i_type.rd,buf);
                         break;
                     }
                     case FUNCT3_LWU: {
                         uint32_t buf;
-                        bool ok = mem_read(mem_addr,4,(char*)&buf);
+                        bool ok = mem_read(mem_addr,buf);
                         if (ok) set_GPR(inst->i_type.rd,buf);
                         break;
                     }
@@ -208,19 +235,19 @@ private:
                 uint64_t mem_addr = GPR[inst->s_type.rs1] + ( (inst->s_type.imm_11_5 << 5) | (inst->s_type.imm_4_0));
                 switch (inst->i_type.funct3) {
                     case FUNCT3_SB: {
-                        mem_write(mem_addr,1,(char*)&GPR[inst->s_type.rs2]);
+                        mem_write(mem_addr,(uint8_t)GPR[inst->s_type.rs2]);
                         break;
                     }
                     case FUNCT3_SH: {
-                        mem_write(mem_addr,2,(char*)&GPR[inst->s_type.rs2]);
+                        mem_write(mem_addr,(uint16_t)GPR[inst->s_type.rs2]);
                         break;
                     }
                     case FUNCT3_SW: {
-                        mem_write(mem_addr,4,(char*)&GPR[inst->s_type.rs2]);
+                        mem_write(mem_addr,(uint32_t)GPR[inst->s_type.rs2]);
                         break;
                     }
                     case FUNCT3_SD: {
-                        mem_write(mem_addr,8,(char*)&GPR[inst->s_type.rs2]);
+                        mem_write(mem_addr,(uint64_t)GPR[inst->s_type.rs2]);
                         break;
                     }
                     default:
@@ -536,6 +563,7 @@ private:
                                             ri = !priv.sret();
                                             break;
                                         case 0b00101: // WFI
+                                            wfi = true;
                                             break;
                                         default:
                                             ri = true;
@@ -642,7 +670,7 @@ private:
                     uint64_t mem_addr = GPR[rs1] + imm;
                     uint8_t rd = 8 + binary_concat(cur_instr,4,2,0);
                     int32_t buf;
-                    bool ok = mem_read(mem_addr,4,(char*)&buf);
+                    bool ok = mem_read(mem_addr,buf);
                     if (ok) set_GPR(rd,buf);
                     break;
                 }
@@ -652,7 +680,7 @@ private:
                     uint64_t mem_addr = GPR[rs1] + imm;
                     uint8_t rd = 8 + binary_concat(cur_instr,4,2,0);
                     int64_t buf;
-                    bool ok = mem_read(mem_addr,8,(char*)&buf);
+                    bool ok = mem_read(mem_addr,buf);
                     if (ok) set_GPR(rd,buf);
                     break;
                 }
@@ -661,7 +689,7 @@ private:
                     uint8_t rs1 = 8 + binary_concat(cur_instr,9,7,0);
                     uint64_t mem_addr = GPR[rs1] + imm;
                     uint8_t rs2 = 8 + binary_concat(cur_instr,4,2,0);
-                    mem_write(mem_addr,4,(char*)&GPR[rs2]);
+                    mem_write(mem_addr,(uint32_t)GPR[rs2]);
                     break;
                 }
                 case OPCODE_C_SD: {
@@ -669,7 +697,7 @@ private:
                     uint8_t rs1 = 8 + binary_concat(cur_instr,9,7,0);
                     uint64_t mem_addr = GPR[rs1] + imm;
                     uint8_t rs2 = 8 + binary_concat(cur_instr,4,2,0);
-                    mem_write(mem_addr,8,(char*)&GPR[rs2]);
+                    mem_write(mem_addr,(uint64_t)GPR[rs2]);
                     break;
                 }
                 case OPCODE_C_ADDI: {
@@ -798,7 +826,7 @@ private:
                     uint64_t mem_addr = GPR[2] + imm;
                     uint8_t rd = binary_concat(cur_instr,11,7,0);
                     int32_t buf;
-                    bool ok = mem_read(mem_addr,4,(char*)&buf);
+                    bool ok = mem_read(mem_addr,buf);
                     if (ok) set_GPR(rd,buf);
                     // TODO: rd != 0
                     break;
@@ -808,7 +836,7 @@ private:
                     uint64_t mem_addr = GPR[2] + imm;
                     uint8_t rd = binary_concat(cur_instr,11,7,0);
                     int64_t buf;
-                    bool ok = mem_read(mem_addr,8,(char*)&buf);
+                    bool ok = mem_read(mem_addr,buf);
                     if (ok) set_GPR(rd,buf);
                     // TODO: rd != 0
                     break;
@@ -861,14 +889,14 @@ private:
                     uint64_t imm = (binary_concat(cur_instr,12,9,2) | binary_concat(cur_instr,8,7,6));
                     uint64_t mem_addr = GPR[2] + imm;
                     uint8_t rs2 = binary_concat(cur_instr,6,2,0);
-                    mem_write(mem_addr,4,(char*)&GPR[rs2]);
+                    mem_write(mem_addr,(uint32_t)GPR[rs2]);
                     break;
                 }
                 case OPCODE_C_SDSP: {
                     uint64_t imm = (binary_concat(cur_instr,12,10,3) | binary_concat(cur_instr,9,7,6));
                     uint64_t mem_addr = GPR[2] + imm;
                     uint8_t rs2 = binary_concat(cur_instr,6,2,0);
-                    mem_write(mem_addr,8,(char*)&GPR[rs2]);
+                    mem_write(mem_addr,(uint64_t)GPR[rs2]);
                     break;
                 }
                 default:
@@ -885,12 +913,13 @@ private:
         else if (!new_pc) pc = pc + (is_rvc ? 2 : 4);
         priv.post_exec();
     }
-    bool mem_read(uint64_t start_addr, uint64_t size, char *buffer) {
-        if (start_addr % size != 0) {
+    template <typename T>
+    bool mem_read(uint64_t start_addr, T &value) {
+        if (start_addr % sizeof(T) != 0) {
             priv.raise_trap(csr_cause_def(exc_load_misalign),start_addr);
             return false;
         }
-        rv_exc_code va_err = priv.va_read(start_addr,size,buffer);
+        rv_exc_code va_err = priv.va_read(start_addr,value);
         if (va_err == exc_custom_ok) {
             return true;
 
@@ -900,12 +929,13 @@ private:
             return false;
         }
     }
-    bool mem_write(uint64_t start_addr, uint64_t size, const char *buffer) {
-        if (start_addr % size != 0) {
+    template <typename T>
+    bool mem_write(uint64_t start_addr, T value) {
+        if (start_addr % sizeof(T) != 0) {
             priv.raise_trap(csr_cause_def(exc_store_misalign),start_addr);
             return false;
         }
-        rv_exc_code va_err = priv.va_write(start_addr,size,buffer);
+        rv_exc_code va_err = priv.va_write(start_addr,value);
         if (va_err == exc_custom_ok) {
             return true;
         }
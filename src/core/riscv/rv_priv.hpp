@@ -12,9 +12,10 @@
 
 extern bool riscv_test;
 
+template <typename bus_t = rv_systembus>
 class rv_priv {
 public:
-    rv_priv(uint64_t hart_id, uint64_t &pc, rv_systembus &bus):hart_id(hart_id),cur_pc(pc),bus(bus),sv39(bus) {
+    rv_priv(uint64_t hart_id, uint64_t &pc, bus_t &bus):hart_id(hart_id),cur_pc(pc),bus(bus),sv39(bus) {
         reset();
     }
     void reset() {
@@ -223,7 +224,7 @@ public:
                 mstatus->sum = nstatus->sum; // always true
                 mstatus->mxr = nstatus->mxr; // always true
                 mstatus->tvm = nstatus->tvm;
-                mstatus->tw = nstatus->tw; // not supported but wfi impl as nop
+                mstatus->tw = nstatus->tw; // not supported
                 mstatus->tsr = nstatus->tsr;
                 break;
             }
@@ -375,35 +376,37 @@ public:
         }
     }
 
-    rv_exc_code va_read(uint64_t start_addr, uint64_t size, char *buffer) {
+    template <typename T>
+    rv_exc_code va_read(uint64_t start_addr, T &value) {
         const satp_def *satp_reg = (satp_def *)&satp;
         const csr_mstatus_def *mstatus = (csr_mstatus_def*)&status;
         if ( (cur_priv == M_MODE && (!mstatus->mprv || mstatus->mpp == M_MODE)) || satp_reg->mode == 0) {
-            bool pstatus = bus.pa_read(start_addr,size,buffer);
+            bool pstatus = bus.read(start_addr,value);
             if (!pstatus) return exc_load_acc_fault;
             else return exc_custom_ok;
         }
         else {
-            if ((start_addr >> 12) != ((start_addr + size - 1) >> 12)) return exc_load_misalign;
+            if ((start_addr >> 12) != ((start_addr + sizeof(T) - 1) >> 12)) return exc_load_misalign;
             sv39_tlb_entry *tlb_e = sv39.local_tlbe_get(*satp_reg,start_addr);
             if (!tlb_e || !tlb_e->A || (!tlb_e->R && !(mstatus->mxr && !tlb_e->X))) return exc_load_pgfault;
             priv_mode priv = (mstatus->mprv && cur_priv == M_MODE) ? static_cast<priv_mode>(mstatus->mpp) : cur_priv;
             if (priv == U_MODE && !tlb_e->U) return exc_load_pgfault;
             if (!mstatus->sum && priv == S_MODE && tlb_e->U) return exc_load_acc_fault;
             uint64_t pa = tlb_e->ppa + (start_addr % ( (tlb_e->pagesize==1)?(1<<12):((tlb_e->pagesize==2)?(1<<21):(1<<30))));
-            bool pstatus = bus.pa_read(pa,size,buffer);
+            bool pstatus = bus.read(pa,value);
             if (!pstatus) return exc_load_acc_fault;
             else return exc_custom_ok;
         }
     }
 
-    rv_exc_code va_write(uint64_t start_addr, uint64_t size, const char *buffer) {
+    template <typename T>
+    rv_exc_code va_write(uint64_t start_addr, T value) {
         const satp_def *satp_reg = (satp_def *)&satp;
         const csr_mstatus_def *mstatus = (csr_mstatus_def*)&status;
         if ( (cur_priv == M_MODE && (!mstatus->mprv || mstatus->mpp == M_MODE)) || satp_reg->mode == 0) {
             if (riscv_test) {
                 if (start_addr == 0x80001000) {
-                    uint64_t tohost = *(uint64_t*)buffer;
+                    uint64_t tohost = (uint64_t)value;
                     if (tohost == 1) {
                         if (tohost == 1) {
                             printf("Test Pass!\n");
@@ -416,12 +419,12 @@ public:
                     }
                 }
             }
-            bool pstatus = bus.pa_write(start_addr,size,buffer);
+            bool pstatus = bus.write(start_addr,value);
             if (!pstatus) return exc_store_acc_fault;
             else return exc_custom_ok;
         }
         else {
-            if ((start_addr >> 12) != ((start_addr + size - 1) >> 12)) return exc_store_misalign;
+            if ((start_addr >> 12) != ((start_addr + sizeof(T) - 1) >> 12)) return exc_store_misalign;
             sv39_tlb_entry *tlb_e = sv39.local_tlbe_get(*satp_reg,start_addr);
             if (!tlb_e || !tlb_e->A || !tlb_e->D || !tlb_e->W) return exc_store_pgfault;
             priv_mode priv = (mstatus->mprv && cur_priv == M_MODE) ? static_cast<priv_mode>(mstatus->mpp) : cur_priv;
@@ -430,7 +433,7 @@ public:
             uint64_t pa = tlb_e->ppa + (start_addr % ( (tlb_e->pagesize==1)?(1<<12):((tlb_e->pagesize==2)?(1<<21):(1<<30))));
             if (riscv_test) {
                 if (pa == 0x80001000) {
-                    uint64_t tohost = *(uint64_t*)buffer;
+                    uint64_t tohost = (uint64_t)value;
                     if (tohost == 1) {
                         if (tohost == 1) {
                             printf("Test Pass!\n");
@@ -443,7 +446,7 @@ public:
                     }
                 }
             }
-            bool pstatus = bus.pa_write(pa,size,buffer);
+            bool pstatus = bus.write(pa,value);
             if (!pstatus) return exc_store_pgfault;
             else return exc_custom_ok;
         }
@@ -603,6 +606,42 @@ public:
     uint64_t get_cycle() {
         return mcycle;
     }
+    void advance_cycle(uint64_t ticks) {
+        mcycle += ticks;
+    }
+    // WFI resumes on any pending interrupt enabled in mie, ignoring mstatus and mideleg.
+    bool int_pending() {
+        return (ip & ie) != 0;
+    }
+    void serialize(checkpoint &cp) {
+        cp.section("rv_priv");
+        cp.io(cur_priv);
+        cp.io(cur_need_trap);
+        cp.io(trap_pc);
+        cp.io(next_priv);
+        cp.io(status);
+        cp.io(misa);
+        cp.io(medeleg);
+        cp.io(mideleg);
+        cp.io(ie);
+        cp.io(mtvec);
+        cp.io(mscratch);
+        cp.io(mepc);
+        cp.io(mcause);
+        cp.io(mtval);
+        cp.io(mcounteren);
+        cp.io(ip);
+        cp.io(mcycle);
+        cp.io(minstret);
+        cp.io(stvec);
+        cp.io(sscratch);
+        cp.io(sepc);
+        cp.io(scause);
+        cp.io(stval);
+        cp.io(satp);
+        cp.io(scounteren);
+        sv39.serialize(cp);
+    }
 private:
     uint64_t int2index(uint64_t int_mask) { // with priority
         /*
@@ -648,7 +687,7 @@ private:
             M[EST]I bits in mideleg is hardwired 0.
             OpenSBI will not delegate these ints to S-Mode. So we don't need to implement.
          */
-        // Note: WFI is not affacted by mstatus.mie and mstatus.sie and mideleg, but we implement WFI as nop currently.
+        // Note: WFI is not affacted by mstatus.mie and mstatus.sie and mideleg, see int_pending.
         csr_mstatus_def *mstatus = (csr_mstatus_def*)&status;
         uint64_t int_bits = ip & ie;
         uint64_t final_int_index = exc_custom_ok;
@@ -679,9 +718,9 @@ private:
     uint64_t trap_pc;
     priv_mode next_priv;
     // sv39
-    rv_sv39<32> sv39;
+    rv_sv39<32, bus_t> sv39;
     // pbus
-    rv_systembus &bus;
+    bus_t &bus;
     // CSRs
     uint64_t        status;
     uint64_t        misa;
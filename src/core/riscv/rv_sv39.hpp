@@ -28,10 +28,10 @@ void mmassert(bool exp, uint64_t satp, uint64_t va, const char* msg = "") {
     }
 }
 #endif
-template <unsigned int nr_tlb_entry = 32>
+template <unsigned int nr_tlb_entry = 32, typename bus_t = rv_systembus>
 class rv_sv39 {
 public:
-    rv_sv39(rv_systembus &bus):bus(bus){
+    rv_sv39(bus_t &bus):bus(bus){
         random = 0;
         for (int i=0;i<nr_tlb_entry;i++) tlb[i].pagesize = 0;
     }
@@ -105,8 +105,12 @@ public:
         if (local_tlb_get(satp,va) != res) assert(false);
         return res;
     }
+    void serialize(checkpoint &cp) {
+        cp.io(random);
+        cp.io(tlb);
+    }
 private:
-    rv_systembus &bus;
+    bus_t &bus;
     unsigned int random;
     sv39_tlb_entry tlb[nr_tlb_entry];
     bool ptw(satp_def satp, uint64_t va_in, sv39_pte &pte_out, uint64_t &pagesize) {
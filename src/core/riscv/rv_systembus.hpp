@@ -6,37 +6,52 @@
 #include <assert.h>
 #include <algorithm>
 #include "mmio_dev.hpp"
-#include <map>
-#include <utility>
-#include <climits>
+#include "device_map.hpp"
+#include "checkpoint.hpp"
 
 // TODO: add pma and check pma
-class rv_systembus {
+// Also an mmio_dev so DMA capable devices can reach memory through it.
+// map_t decodes addresses, see memory_bus.
+template <typename map_t = device_map>
+class basic_rv_systembus : public mmio_dev {
 public:
+    basic_rv_systembus() {
+        devices.set_dmi_listener([this]() { invalidate_dmi(); });
+    }
+    // Devices of a static_map, in the order of its ranges.
+    template <typename dev_t, typename... devs_t>
+    basic_rv_systembus(dev_t &dev, devs_t&... devs):devices(dev, devs...) {
+        devices.set_dmi_listener([this]() { invalidate_dmi(); });
+    }
+    bool do_read(uint64_t start_addr, uint64_t size, char* buffer) {
+        return pa_read(start_addr, size, buffer);
+    }
+    bool do_write(uint64_t start_addr, uint64_t size, const char* buffer) {
+        return pa_write(start_addr, size, buffer);
+    }
+    bool get_dmi(uint64_t addr, dmi_region &region) {
+        return devices.get_dmi(addr, region);
+    }
     bool pa_read(uint64_t start_addr, uint64_t size, char *buffer) {
-        auto it = devices.upper_bound(std::make_pair(start_addr,ULONG_MAX));
-        if (it == devices.begin()) return false;
-        it = std::prev(it);
-        uint64_t end_addr = start_addr + size;
-        if (it->first.first <= start_addr && end_addr <= it->first.second) {
-            uint64_t dev_size = it->first.second - it->first.first;
-            return it->second.first->do_read(it->second.second ? start_addr : start_addr % dev_size, size, buffer);
-        }
-        else return false;
+        return devices.read(start_addr, size, buffer);
     }
     bool pa_write(uint64_t start_addr, uint64_t size, const char *buffer) {
         if (start_addr <= lr_pa && lr_pa + size <= start_addr + size) {
             lr_valid = false;
         }
-        auto it = devices.upper_bound(std::make_pair(start_addr,ULONG_MAX));
-        if (it == devices.begin()) return false;
-        it = std::prev(it);
-        uint64_t end_addr = start_addr + size;
-        if (it->first.first <= start_addr && end_addr <= it->first.second) {
-            uint64_t dev_size = it->first.second - it->first.first;
-            return it->second.first->do_write(it->second.second ? start_addr : start_addr % dev_size, size, buffer);
+        return devices.write(start_addr, size, buffer);
+    }
+    // Fixed size accesses, RAM hits compile down to a single host load or store.
+    template <typename T>
+    bool read(uint64_t addr, T &value) {
+        return devices.read(addr, value);
+    }
+    template <typename T>
+    bool write(uint64_t addr, T value) {
+        if (addr <= lr_pa && lr_pa + sizeof(T) <= addr + sizeof(T)) {
+            lr_valid = false;
         }
-        else return false;
+        return devices.write(addr, value);
     }
     // note: check address alignment in the core and raise address misalign exception
     bool pa_lr(uint64_t pa, uint64_t size, char *dst, uint64_t hart_id) {
@@ -106,31 +121,24 @@ public:
         return pa_write(pa,size,(char*)&to_write);
     }
     bool add_dev(uint64_t start_addr, uint64_t length, mmio_dev *dev, bool raw_addr = false) {
-        std::pair<uint64_t, uint64_t> addr_range = std::make_pair(start_addr,start_addr+length);
-        if (start_addr % length) return false;
-        // check range
-        auto it = devices.upper_bound(addr_range);
-        if (it != devices.end()) {
-            uint64_t l_max = std::max(it->first.first,addr_range.first);
-            uint64_t r_min = std::min(it->first.second,addr_range.second);
-            if (l_max < r_min) return false; // overleap
-        }
-        if (it != devices.begin()) {
-            it = std::prev(it);
-            uint64_t l_max = std::max(it->first.first,addr_range.first);
-            uint64_t r_min = std::min(it->first.second,addr_range.second);
-            if (l_max < r_min) return false; // overleap
-        }
-        // overleap check pass
-        devices[addr_range] = std::make_pair(dev, raw_addr);
-        return true;
+        return devices.add(start_addr, length, dev, raw_addr);
+    }
+    // The LR reservation, devices are checkpointed by the machine.
+    void serialize(checkpoint &cp) {
+        cp.section("rv_systembus");
+        cp.io(lr_pa);
+        cp.io(lr_size);
+        cp.io(lr_hart);
+        cp.io(lr_valid);
     }
 private:
     uint64_t lr_pa;
     uint64_t lr_size;
     uint64_t lr_hart;
     bool lr_valid = false;
-    std::map < std::pair<uint64_t,uint64_t>, std::pair<mmio_dev*,bool> > devices;
+    map_t devices;
 };
 
+typedef basic_rv_systembus<> rv_systembus;
+
 #endif
\ No newline at end of file
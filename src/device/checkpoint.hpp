@@ -0,0 +1,86 @@
+#ifndef CHECKPOINT_HPP
+#define CHECKPOINT_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <type_traits>
+#include <vector>
+
+// Saved machine state in a file. Each component has a serialize(checkpoint &cp) method passing
+// its state to cp.io() field by field, the same method saves and restores. A machine checkpoints
+// its event_queue first and then every component in a fixed order, restoring needs a machine
+// built the same way. Host I/O threads should be quiet while a checkpoint is taken or restored.
+class checkpoint {
+public:
+    enum mode_t { SAVE, RESTORE };
+    checkpoint(const char *path, mode_t mode):mode(mode) {
+        fp = fopen(path, mode == SAVE ? "wb" : "rb");
+        ok = fp != nullptr;
+        section("cemu checkpoint v1");
+    }
+    // Checkpoint kept in memory, to go back to the same state many times without the disk.
+    checkpoint(std::vector<char> &buffer, mode_t mode):mode(mode),fp(nullptr),buffer(&buffer) {
+        ok = true;
+        if (mode == SAVE) buffer.clear();
+        section("cemu checkpoint v1");
+    }
+    ~checkpoint() {
+        if (fp) fclose(fp);
+    }
+    bool saving() const {
+        return mode == SAVE;
+    }
+    // False after any I/O error or layout mismatch, the restored state is unusable then.
+    bool good() const {
+        return ok;
+    }
+    void io(void *data, size_t len) {
+        if (!ok) return;
+        if (buffer && mode == SAVE) buffer->insert(buffer->end(), (char*)data, (char*)data + len);
+        else if (buffer) {
+            ok = len <= buffer->size() - pos;
+            if (ok) memcpy(data, buffer->data() + pos, len);
+            pos += ok ? len : 0;
+        }
+        else if (mode == SAVE) ok = fwrite(data, 1, len, fp) == len;
+        else ok = fread(data, 1, len, fp) == len;
+    }
+    template <typename T>
+    void io(T &value) {
+        static_assert(std::is_trivially_copyable<T>::value, "checkpoint fields must be trivially copyable");
+        io(&value, sizeof(T));
+    }
+    template <typename T>
+    void io(std::atomic<T> &value) {
+        T tmp = value;
+        io(tmp);
+        if (mode == RESTORE) value = tmp;
+    }
+    // Components start with a tag, restoring into a machine of another layout stops at the first difference.
+    void section(const char *name) {
+        char tag[32] = {};
+        strncpy(tag, name, sizeof(tag) - 1);
+        char got[32];
+        memcpy(got, tag, sizeof(tag));
+        io(got, sizeof(got));
+        if (ok && memcmp(got, tag, sizeof(tag)) != 0) {
+            fprintf(stderr, "checkpoint: expected %s, found %.32s\n", name, got);
+            ok = false;
+        }
+    }
+    // For state that does not fit the machine being restored.
+    void fail(const char *reason) {
+        if (ok) fprintf(stderr, "checkpoint: %s\n", reason);
+        ok = false;
+    }
+private:
+    mode_t mode;
+    FILE *fp;
+    std::vector<char> *buffer = nullptr;
+    size_t pos = 0;
+    bool ok;
+};
+
+#endif
@@ -0,0 +1,170 @@
+#ifndef CONSOLE_OUTPUT_HPP
+#define CONSOLE_OUTPUT_HPP
+
+#include <cstdint>
+#include <cstdlib>
+#include <cerrno>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <new>
+#include <unistd.h>
+
+// Host side of the guest consoles. A dedicated thread drains the UART TX rings, translates
+// line endings and writes to the host in large chunks, so guest output never blocks the core.
+class console_output {
+public:
+    enum newline_mode {
+        NEWLINE_RAW,        // pass bytes through
+        NEWLINE_CRLF_TO_LF, // collapse CRLF to LF, a lone CR is kept
+        NEWLINE_DROP_CR     // drop every CR
+    };
+    console_output(newline_mode mode = NEWLINE_RAW, int fd = STDOUT_FILENO):mode(mode),fd(fd) {
+        pending_cr = false;
+        running = true;
+        sleeping = false;
+        worker = std::thread(&console_output::run, this);
+        std::unique_lock<std::mutex> lock(instances_lock());
+        if (instances().empty()) std::atexit(flush_all);
+        instances().push_back(this);
+    }
+    ~console_output() {
+        {
+            std::unique_lock<std::mutex> lock(instances_lock());
+            for (size_t i=0;i<instances().size();i++) if (instances()[i] == this) instances().erase(instances().begin() + i);
+        }
+        {
+            std::unique_lock<std::mutex> lock(wake_lock);
+            running = false;
+            wake.notify_one();
+        }
+        worker.join();
+        flush();
+    }
+    // Attach a UART, its TX ring is consumed by the output thread from now on.
+    template <typename uart_t>
+    void attach(uart_t &uart) {
+        std::unique_lock<std::mutex> lock(drain_lock);
+        sources.push_back([&uart](char &c) {
+            if (!uart.exist_tx()) return false;
+            c = uart.getc();
+            return true;
+        });
+        uart.set_tx_notify([this]() { notify(); });
+    }
+    // Called by the emulation thread after queuing TX bytes, only wakes the thread if it sleeps.
+    void notify() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping.load(std::memory_order_relaxed)) {
+            std::unique_lock<std::mutex> lock(wake_lock);
+            wake.notify_one();
+        }
+    }
+    // Write everything queued so far, used before the process exits.
+    void flush() {
+        std::unique_lock<std::mutex> lock(drain_lock);
+        while (drain());
+        if (pending_cr) {
+            out.push_back('\r');
+            pending_cr = false;
+        }
+        write_out();
+    }
+    // In a process created by fork() the output thread does not exist and its locks may be held.
+    // Start over with a new thread, bytes the old one had taken are written by the parent.
+    void restart_after_fork() {
+        new (&drain_lock) std::mutex();
+        new (&wake_lock) std::mutex();
+        new (&wake) std::condition_variable();
+        out.clear();
+        sleeping = false;
+        new (&worker) std::thread(&console_output::run, this); // the old handle refers to nothing here
+    }
+private:
+    void run() {
+        while (running) {
+            if (drain_and_write()) continue;
+            // announce sleeping, then look once more so a notify() cannot slip in between
+            std::unique_lock<std::mutex> lock(wake_lock);
+            sleeping = true;
+            if (!drain_and_write() && running) wake.wait_for(lock, std::chrono::milliseconds(100));
+            sleeping = false;
+        }
+    }
+    bool drain_and_write() {
+        std::unique_lock<std::mutex> lock(drain_lock);
+        return drain();
+    }
+    // Move available TX bytes to the host in one chunk, returns false if there were none.
+    bool drain() {
+        char c;
+        bool got = false;
+        for (auto &source : sources) {
+            while (out.size() < chunk_size && source(c)) {
+                put(c);
+                got = true;
+            }
+        }
+        write_out();
+        return got;
+    }
+    void put(char c) {
+        switch (mode) {
+            case NEWLINE_RAW:
+                out.push_back(c);
+                break;
+            case NEWLINE_CRLF_TO_LF:
+                if (c == '\r') {
+                    if (pending_cr) out.push_back('\r');
+                    pending_cr = true;
+                    break;
+                }
+                if (pending_cr && c != '\n') out.push_back('\r');
+                pending_cr = false;
+                out.push_back(c);
+                break;
+            case NEWLINE_DROP_CR:
+                if (c != '\r') out.push_back(c);
+                break;
+        }
+    }
+    void write_out() {
+        size_t pos = 0;
+        while (pos < out.size()) {
+            ssize_t res = write(fd, out.data() + pos, out.size() - pos);
+            if (res < 0 && errno == EINTR) continue;
+            if (res <= 0) break; // host side closed, drop the output
+            pos += res;
+        }
+        out.clear();
+    }
+    static void flush_all() {
+        std::unique_lock<std::mutex> lock(instances_lock());
+        for (auto console : instances()) console->flush();
+    }
+    static std::vector<console_output*> &instances() {
+        static std::vector<console_output*> list;
+        return list;
+    }
+    static std::mutex &instances_lock() {
+        static std::mutex lock;
+        return lock;
+    }
+    static const size_t chunk_size = 64 * 1024;
+    newline_mode mode;
+    int fd;
+    bool pending_cr;
+    std::vector<char> out;
+    std::vector<std::function<bool(char&)> > sources;
+    std::thread worker;
+    std::mutex drain_lock; // sources are consumed by the worker or by flush(), never both
+    std::mutex wake_lock;
+    std::condition_variable wake;
+    std::atomic<bool> running;
+    std::atomic<bool> sleeping;
+};
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef EVENT_QUEUE_HPP
+#define EVENT_QUEUE_HPP
+
+#include <cstdint>
+#include <vector>
+#include <queue>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include "checkpoint.hpp"
+
+// Virtual time shared by the timer devices of a machine.
+// Devices derive their counters from now() and schedule a callback at their next deadline,
+// so the machine loop only advances time instead of polling every timer on each step.
+// Except post(), all methods belong to the emulation thread.
+class event_queue {
+public:
+    event_queue() {
+        cur_time = 0;
+        next_deadline = UINT64_MAX;
+        has_posted = false;
+    }
+    uint64_t now() const {
+        return cur_time;
+    }
+    // Register a timer, the returned id is used to schedule or cancel it.
+    int add_timer(std::function<void()> callback) {
+        timers.push_back({callback, 0});
+        return timers.size() - 1;
+    }
+    // Fire the timer once now() reaches deadline, replacing any earlier schedule.
+    void schedule(int id, uint64_t deadline) {
+        timers[id].generation ++;
+        heap.push({deadline, timers[id].generation, id});
+        if (deadline < next_deadline.load(std::memory_order_relaxed)) set_next_deadline(deadline);
+    }
+    void cancel(int id) {
+        timers[id].generation ++;
+    }
+    // Run the callback of timer id on the emulation thread at the next tick, may be called from any thread.
+    // Host I/O threads use it to hand received data to a device without touching guest memory themselves.
+    void post(int id) {
+        {
+            std::unique_lock<std::mutex> lock(post_lock);
+            posted.push_back(id);
+        }
+        has_posted = true;
+        next_deadline = 0;
+    }
+    // Ticks until the earliest armed timer fires, UINT64_MAX if none.
+    uint64_t next_event() {
+        drop_stale();
+        if (has_posted) return 0;
+        if (heap.empty()) return UINT64_MAX;
+        return heap.top().deadline > cur_time ? heap.top().deadline - cur_time : 0;
+    }
+    void tick() {
+        if (++cur_time >= next_deadline.load(std::memory_order_relaxed)) run_due();
+    }
+    void advance(uint64_t ticks) {
+        cur_time += ticks;
+        if (cur_time >= next_deadline.load(std::memory_order_relaxed)) run_due();
+    }
+    // Move to an absolute time, used to follow the host clock. Time never goes backwards.
+    void set_time(uint64_t time) {
+        if (time > cur_time) advance(time - cur_time);
+    }
+    // Only the time is saved. Restoring drops every schedule, devices arm their timers
+    // again from their own restored state, so the queue must be restored before them.
+    void serialize(checkpoint &cp) {
+        cp.section("event_queue");
+        cp.io(cur_time);
+        if (!cp.saving()) {
+            for (auto &t : timers) t.generation ++;
+            heap = decltype(heap)();
+            set_next_deadline(UINT64_MAX);
+        }
+    }
+private:
+    struct timer {
+        std::function<void()> callback;
+        uint64_t generation;
+    };
+    struct entry {
+        uint64_t deadline;
+        uint64_t generation;
+        int id;
+        bool operator>(const entry &other) const {
+            return deadline > other.deadline;
+        }
+    };
+    void drop_stale() {
+        while (!heap.empty() && heap.top().generation != timers[heap.top().id].generation) heap.pop();
+        set_next_deadline(heap.empty() ? UINT64_MAX : heap.top().deadline);
+    }
+    // post() zeroes next_deadline from another thread, look at has_posted after the store so it is never lost.
+    void set_next_deadline(uint64_t deadline) {
+        next_deadline = deadline;
+        if (has_posted) next_deadline = 0;
+    }
+    void run_posted() {
+        std::vector<int> ids;
+        has_posted = false;
+        {
+            std::unique_lock<std::mutex> lock(post_lock);
+            ids.swap(posted);
+        }
+        for (int id : ids) timers[id].callback();
+    }
+    void run_due() {
+        if (has_posted) run_posted();
+        drop_stale();
+        while (!heap.empty() && heap.top().deadline <= cur_time) {
+            int id = heap.top().id;
+            heap.pop();
+            // the callback may schedule the timer again
+            timers[id].callback();
+            drop_stale();
+        }
+    }
+    uint64_t cur_time;
+    std::atomic<uint64_t> next_deadline;
+    std::atomic<bool> has_posted;
+    std::mutex post_lock;
+    std::vector<int> posted;
+    std::vector<timer> timers;
+    std::priority_queue<entry, std::vector<entry>, std::greater<entry> > heap;
+};
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef FORK_SNAPSHOTS_HPP
+#define FORK_SNAPSHOTS_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <deque>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+// Snapshots of the whole emulator taken with fork(). A snapshot is a child process parked right
+// after the fork, the kernel shares its memory with the running process copy-on-write, so taking
+// one costs about the same for any guest memory size. Rewinding hands the machine over to the
+// newest snapshot: the running process exits and the snapshot continues from where it was taken,
+// keeping the older snapshots so it can be rewound again.
+//
+// The process that creates fork_snapshots stays behind as a supervisor. It only waits for the
+// process currently running the machine and exits with its status, so the shell sees one
+// command from start to end. Only the thread calling take() exists in a resumed snapshot, the
+// caller has to start its host threads again.
+class fork_snapshots {
+public:
+    // Call before any host thread is started, the supervisor never returns from here.
+    fork_snapshots(size_t keep):keep(keep) {
+        active = (pid_t*)mmap(nullptr, sizeof(pid_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (active == MAP_FAILED) {
+            perror("fork_snapshots: mmap");
+            exit(1);
+        }
+        // snapshots outlive the runner that forked them, they are reparented to the supervisor
+        prctl(PR_SET_CHILD_SUBREAPER, 1);
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork_snapshots: fork");
+            exit(1);
+        }
+        *active = pid ? pid : getpid();
+        if (pid) supervise();
+    }
+    // Park a copy of the process at guest time. Returns false in the running process, and true
+    // in the copy once it is resumed by rewind().
+    bool take(uint64_t time) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) return false;
+        pid_t pid = fork();
+        if (pid < 0) {
+            close(fds[0]);
+            close(fds[1]);
+            return false;
+        }
+        if (pid == 0) {
+            close(fds[0]);
+            return park(fds[1]);
+        }
+        close(fds[1]);
+        snapshots.push_back({pid, fds[0], time});
+        while (snapshots.size() > keep) {
+            drop(snapshots.front());
+            snapshots.pop_front();
+        }
+        return false;
+    }
+    // Continue from the newest snapshot, does not return unless there is none left.
+    bool rewind() {
+        while (!snapshots.empty()) {
+            snapshot s = snapshots.back();
+            snapshots.pop_back();
+            *active = s.pid; // set first, the supervisor must not take our exit for the end
+            char cmd = 'r';
+            bool resumed = send(s.fd, &cmd, 1, MSG_NOSIGNAL) == 1;
+            close(s.fd);
+            if (resumed) _exit(0);
+        }
+        *active = getpid();
+        return false;
+    }
+    size_t size() {
+        return snapshots.size();
+    }
+    // Guest time of the newest snapshot.
+    uint64_t newest() {
+        return snapshots.empty() ? 0 : snapshots.back().time;
+    }
+private:
+    struct snapshot {
+        pid_t pid;
+        int fd;
+        uint64_t time;
+    };
+    [[noreturn]] void supervise() {
+        signal(SIGINT, SIG_IGN);
+        signal(SIGUSR1, SIG_IGN);
+        signal(SIGUSR2, SIG_IGN);
+        signal(SIGTERM, forward);
+        signal(SIGHUP, forward);
+        while (1) {
+            int status;
+            pid_t pid = waitpid(-1, &status, 0);
+            if (pid < 0 && errno == EINTR) continue;
+            if (pid < 0) exit(1);
+            if (pid == *active) exit(WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+        }
+    }
+    // Wait for 'r' from the runner. The socket closes when the runner dies without resuming us,
+    // older snapshots inherited by this one close in turn once it exits.
+    bool park(int fd) {
+        const int signals[] = {SIGINT, SIGUSR1, SIGUSR2};
+        struct sigaction ignore = {}, saved[3];
+        ignore.sa_handler = SIG_IGN;
+        for (int i = 0; i < 3; i++) sigaction(signals[i], &ignore, &saved[i]);
+        char cmd = 0;
+        while (read(fd, &cmd, 1) < 0 && errno == EINTR);
+        close(fd);
+        if (cmd != 'r') _exit(0);
+        for (int i = 0; i < 3; i++) sigaction(signals[i], &saved[i], nullptr);
+        return true;
+    }
+    // Termination aimed at the supervisor goes to the machine, parked snapshots follow it.
+    static void forward(int sig) {
+        kill(*active, sig);
+    }
+    void drop(snapshot &s) {
+        char cmd = 'x';
+        send(s.fd, &cmd, 1, MSG_NOSIGNAL);
+        close(s.fd);
+        waitpid(s.pid, nullptr, 0); // fails for snapshots inherited from an earlier runner
+    }
+    size_t keep;
+    static inline pid_t *active; // process running the machine, shared with the supervisor
+    std::deque<snapshot> snapshots;
+};
+
+#endif
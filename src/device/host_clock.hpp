@@ -0,0 +1,62 @@
+#ifndef HOST_CLOCK_HPP
+#define HOST_CLOCK_HPP
+
+#include <cstdint>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <new>
+
+// Guest time source following the host monotonic clock, counting at the guest timebase frequency.
+class host_clock {
+public:
+    host_clock(uint64_t frequency):frequency(frequency) {
+        start = std::chrono::steady_clock::now();
+        notified = false;
+    }
+    uint64_t now() {
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        return (unsigned __int128)ns * frequency / 1000000000u;
+    }
+    // Continue counting from time, e.g. after restoring a checkpoint.
+    void set_now(uint64_t time) {
+        uint64_t ns = (unsigned __int128)time * 1000000000u / frequency;
+        start = std::chrono::steady_clock::now() - std::chrono::nanoseconds(ns);
+    }
+    // Block until guest time reaches deadline or notify() is called.
+    // Wait at most max_wait_ms so the caller can still poll flags set by signal handlers.
+    void wait_until(uint64_t deadline, uint64_t max_wait_ms = 10) {
+        auto limit = std::chrono::steady_clock::now() + std::chrono::milliseconds(max_wait_ms);
+        auto host_deadline = limit;
+        unsigned __int128 deadline_ns = (unsigned __int128)deadline * 1000000000u / frequency;
+        if (deadline_ns < (unsigned __int128)std::chrono::duration_cast<std::chrono::nanoseconds>(limit - start).count()) {
+            host_deadline = start + std::chrono::nanoseconds((uint64_t)deadline_ns);
+        }
+        std::unique_lock<std::mutex> lock(wait_lock);
+        wake.wait_until(lock, host_deadline, [this]() { return notified; });
+        notified = false;
+    }
+    // Called by host input threads to wake an idle guest.
+    void notify() {
+        std::unique_lock<std::mutex> lock(wait_lock);
+        notified = true;
+        wake.notify_one();
+    }
+    // In a process created by fork() an input thread of the parent may have held the lock.
+    void restart_after_fork() {
+        new (&wait_lock) std::mutex();
+        new (&wake) std::condition_variable();
+        notified = false;
+    }
+    uint64_t get_frequency() {
+        return frequency;
+    }
+private:
+    uint64_t frequency;
+    std::chrono::steady_clock::time_point start;
+    std::mutex wait_lock;
+    std::condition_variable wake;
+    bool notified;
+};
+
+#endif
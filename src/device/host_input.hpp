@@ -0,0 +1,50 @@
+#ifndef HOST_INPUT_HPP
+#define HOST_INPUT_HPP
+
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+// Host keyboard input for the guest console. The input thread is the only producer of a
+// device's rx ring, so Ctrl-C caught by SIGINT on the emulation thread is not pushed from there,
+// it goes through a pipe and the input thread reads it back like a typed ^C.
+class host_input {
+public:
+    host_input() {
+        if (pipe(ctrl_c) < 0) ctrl_c[0] = ctrl_c[1] = -1;
+        else for (int fd : ctrl_c) fcntl(fd, F_SETFL, O_NONBLOCK);
+    }
+    // Any thread, never blocks. Dropped when the input thread is far behind.
+    void send_ctrl_c() {
+        char c = 3;
+        if (write(ctrl_c[1], &c, 1) < 0) return;
+    }
+    // Input thread. Blocks until a Ctrl-C is pending or stdin has bytes, returns like read().
+    // Once stdin ends it keeps waiting for Ctrl-C.
+    ssize_t read(char *buf, size_t len) {
+        pollfd fds[2] = {{ctrl_c[0], POLLIN, 0}, {stdin_open ? STDIN_FILENO : -1, POLLIN, 0}};
+        while (true) {
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            if (fds[0].revents) {
+                ssize_t n = ::read(ctrl_c[0], buf, len);
+                if (n > 0) return n;
+            }
+            if (fds[1].revents) {
+                ssize_t n = ::read(STDIN_FILENO, buf, len);
+                if (n > 0) return n;
+                if (n < 0 && errno == EINTR) continue;
+                stdin_open = false;
+                fds[1].fd = -1;
+            }
+        }
+    }
+private:
+    int ctrl_c[2];
+    bool stdin_open = true;
+};
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef INPUT_LOG_HPP
+#define INPUT_LOG_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <thread>
+#include "spsc_ring.hpp"
+
+// Record and replay of host input, the only thing that differs between two runs of the same
+// image without -realtime. When recording, the host input thread hands bytes to putc() instead
+// of a device, and the emulation thread delivers them at a step boundary, logging the guest
+// time. Replaying delivers the logged bytes at the same guest times, no input thread is needed.
+//
+// The log is a header followed by records of a uint64_t guest time, a uint32_t length and the
+// bytes. Records are flushed as they are written, so the log survives a crashed run.
+class input_log {
+public:
+    enum mode_t { RECORD, REPLAY };
+    input_log(const char *path, mode_t mode):mode(mode) {
+        fp = fopen(path, mode == RECORD ? "wb" : "rb");
+        char header[16] = "cemu input v1";
+        if (fp && mode == RECORD) fwrite(header, 1, sizeof(header), fp);
+        if (fp && mode == REPLAY) {
+            char got[16];
+            if (fread(got, 1, sizeof(got), fp) != sizeof(got) || memcmp(got, header, sizeof(header)) != 0) {
+                fclose(fp);
+                fp = nullptr;
+            }
+            else read_next();
+        }
+    }
+    ~input_log() {
+        if (fp) fclose(fp);
+    }
+    bool is_open() {
+        return fp != nullptr;
+    }
+    // Host input thread, recording only. Blocks while the emulation thread is behind.
+    void putc(const char *buf, size_t len) {
+        while (len) {
+            size_t n = pending.push(buf, len);
+            if (!n) std::this_thread::yield();
+            buf += n;
+            len -= n;
+        }
+    }
+    // Cheap test for the emulation thread, whether deliver() has something to do at time now.
+    bool due(uint64_t now) {
+        if (!backlog.empty()) return true;
+        return mode == RECORD ? !pending.empty() : next_time <= now;
+    }
+    // Offer the input due at time now to the device, put(buf, len) returns how many bytes it took.
+    // What it does not take is offered again on the next call.
+    template <typename F>
+    void deliver(uint64_t now, F put) {
+        if (mode == RECORD) {
+            char buf[256];
+            size_t n;
+            while ((n = pending.pop(buf, sizeof(buf)))) backlog.insert(backlog.end(), buf, buf + n);
+        }
+        else {
+            while (next_time <= now) {
+                backlog.insert(backlog.end(), next_data.begin(), next_data.end());
+                read_next();
+            }
+        }
+        if (backlog.empty()) return;
+        size_t taken = put(backlog.data(), backlog.size());
+        if (mode == RECORD && taken) write(now, backlog.data(), taken);
+        backlog.erase(backlog.begin(), backlog.begin() + taken);
+    }
+    // Input created on the emulation thread itself, such as Ctrl-C, goes through the log as well.
+    template <typename F>
+    void inject(uint64_t now, const char *buf, size_t len, F put) {
+        if (mode == REPLAY) return; // it is in the log already
+        if (!backlog.empty()) {
+            backlog.insert(backlog.end(), buf, buf + len);
+            return;
+        }
+        size_t taken = put(buf, len);
+        if (taken) write(now, buf, taken);
+        backlog.insert(backlog.end(), buf + taken, buf + len);
+    }
+    // Replay only, true once every record has been delivered.
+    bool finished() {
+        return mode == REPLAY && next_time == UINT64_MAX && backlog.empty();
+    }
+private:
+    void write(uint64_t time, const char *buf, uint32_t len) {
+        fwrite(&time, sizeof(time), 1, fp);
+        fwrite(&len, sizeof(len), 1, fp);
+        fwrite(buf, 1, len, fp);
+        fflush(fp);
+    }
+    void read_next() {
+        uint32_t len;
+        next_time = UINT64_MAX;
+        if (fread(&next_time, sizeof(next_time), 1, fp) != 1 || fread(&len, sizeof(len), 1, fp) != 1) {
+            next_time = UINT64_MAX;
+            return;
+        }
+        next_data.resize(len);
+        if (fread(next_data.data(), 1, len, fp) != len) next_time = UINT64_MAX; // truncated by a crash
+    }
+    mode_t mode;
+    FILE *fp;
+    spsc_ring<char, 4096> pending; // host input thread -> emulation thread
+    std::vector<char> backlog;     // due but not yet taken by the device
+    uint64_t next_time = UINT64_MAX;
+    std::vector<char> next_data;
+};
+
+#endif
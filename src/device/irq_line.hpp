@@ -0,0 +1,73 @@
+#ifndef IRQ_LINE_HPP
+#define IRQ_LINE_HPP
+
+#include <cstdint>
+#include <atomic>
+
+// Interrupt controller input, set_irq may be called from any thread.
+class irq_sink {
+public:
+    virtual void set_irq(unsigned int id, bool level) = 0;
+};
+
+// Interrupt output of a device, pushes level changes to the connected controller.
+// set() may race between a device's MMIO path and its host I/O thread, so devices
+// re-check their interrupt condition after set() (see update_irq in the uarts).
+class irq_line {
+public:
+    irq_line() {
+        sink = nullptr;
+        id = 0;
+        level = false;
+    }
+    void connect(irq_sink *new_sink, unsigned int new_id) {
+        while (busy.test_and_set(std::memory_order_acquire));
+        sink = new_sink;
+        id = new_id;
+        if (sink) sink->set_irq(id, level);
+        busy.clear(std::memory_order_release);
+    }
+    void set(bool new_level) {
+        if (level.load() == new_level) return;
+        while (busy.test_and_set(std::memory_order_acquire));
+        if (level.exchange(new_level) != new_level && sink) sink->set_irq(id, new_level);
+        busy.clear(std::memory_order_release);
+    }
+    bool get() {
+        return level;
+    }
+    // Edge triggered interrupt, the controller latches the rising edge.
+    void pulse() {
+        while (busy.test_and_set(std::memory_order_acquire));
+        if (sink) {
+            sink->set_irq(id, true);
+            sink->set_irq(id, level);
+        }
+        busy.clear(std::memory_order_release);
+    }
+private:
+    irq_sink *sink;
+    unsigned int id;
+    std::atomic<bool> level;
+    std::atomic_flag busy = ATOMIC_FLAG_INIT;
+};
+
+// Level summary of external interrupt pins, e.g. MIPS Cause.IP[6:2] or LA32R ESTAT.IS[9:2].
+// The core reads it once per step with a relaxed load.
+class irq_pins : public irq_sink {
+public:
+    irq_pins() {
+        pins = 0;
+    }
+    void set_irq(unsigned int id, bool level) {
+        if (level) pins.fetch_or(1u << id, std::memory_order_relaxed);
+        else pins.fetch_and(~(1u << id), std::memory_order_relaxed);
+    }
+    uint32_t get() {
+        return pins.load(std::memory_order_relaxed);
+    }
+private:
+    std::atomic<uint32_t> pins;
+};
+
+#endif
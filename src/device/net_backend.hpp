@@ -0,0 +1,140 @@
+#ifndef NET_BACKEND_HPP
+#define NET_BACKEND_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Host side of an emulated NIC. Received frames are delivered from a thread owned by the
+// backend, send() is called by the emulation thread.
+class net_backend {
+public:
+    typedef std::function<void(const char*, size_t)> receive_func;
+    virtual void start(receive_func receive) = 0;
+    virtual void send(const char *frame, size_t len) = 0;
+    virtual ~net_backend() {}
+};
+
+// One frame per datagram on a UNIX domain socket, two instances pointing at each other's path
+// form a point to point link.
+class unix_dgram_backend : public net_backend {
+public:
+    unix_dgram_backend(const char *local_path, const char *peer_path) {
+        fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+        memset(&local, 0, sizeof(local));
+        memset(&peer, 0, sizeof(peer));
+        local.sun_family = AF_UNIX;
+        peer.sun_family = AF_UNIX;
+        strncpy(local.sun_path, local_path, sizeof(local.sun_path) - 1);
+        strncpy(peer.sun_path, peer_path, sizeof(peer.sun_path) - 1);
+        unlink(local.sun_path);
+        if (fd < 0 || bind(fd, (sockaddr*)&local, sizeof(local)) != 0) perror("unix_dgram_backend");
+    }
+    ~unix_dgram_backend() {
+        if (fd >= 0) shutdown(fd, SHUT_RDWR);
+        if (rx_thread.joinable()) rx_thread.join();
+        if (fd >= 0) close(fd);
+        unlink(local.sun_path);
+    }
+    void start(receive_func receive) {
+        rx_thread = std::thread([this, receive]() {
+            char frame[65536];
+            while (true) {
+                ssize_t n = recv(fd, frame, sizeof(frame), 0);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) break;
+                receive(frame, n);
+            }
+        });
+    }
+    void send(const char *frame, size_t len) {
+        // a missing peer loses the frame, like a cable that is not plugged in
+        sendto(fd, frame, len, 0, (sockaddr*)&peer, sizeof(peer));
+    }
+private:
+    int fd;
+    sockaddr_un local;
+    sockaddr_un peer;
+    std::thread rx_thread;
+};
+
+// Replays the frames of a pcap file into the guest as fast as it takes them, and captures
+// guest frames into another pcap file. Either path may be null.
+class pcap_backend : public net_backend {
+public:
+    pcap_backend(const char *replay_path, const char *capture_path) {
+        replay = replay_path ? fopen(replay_path, "rb") : nullptr;
+        capture = capture_path ? fopen(capture_path, "wb") : nullptr;
+        if (replay_path && !replay) perror("pcap_backend: replay");
+        if (capture_path && !capture) perror("pcap_backend: capture");
+        if (capture) {
+            pcap_file_header hdr = {0xa1b2c3d4u, 2, 4, 0, 0, 65535, 1}; // LINKTYPE_ETHERNET
+            fwrite(&hdr, sizeof(hdr), 1, capture);
+        }
+        running = true;
+    }
+    ~pcap_backend() {
+        running = false;
+        if (rx_thread.joinable()) rx_thread.join();
+        if (replay) fclose(replay);
+        if (capture) fclose(capture);
+    }
+    void start(receive_func receive) {
+        if (!replay) return;
+        rx_thread = std::thread([this, receive]() {
+            pcap_file_header hdr;
+            if (fread(&hdr, sizeof(hdr), 1, replay) != 1) return;
+            // written on a host of the other byte order
+            bool swap = hdr.magic == 0xd4c3b2a1u || hdr.magic == 0x4d3cb2a1u;
+            if (!swap && hdr.magic != 0xa1b2c3d4u && hdr.magic != 0xa1b23c4du) {
+                fprintf(stderr, "pcap_backend: not a pcap file\n");
+                return;
+            }
+            char frame[65536];
+            pcap_record_header rec;
+            while (running && fread(&rec, sizeof(rec), 1, replay) == 1) {
+                uint32_t len = swap ? __builtin_bswap32(rec.incl_len) : rec.incl_len;
+                if (len > sizeof(frame) || fread(frame, 1, len, replay) != len) break;
+                receive(frame, len);
+            }
+        });
+    }
+    void send(const char *frame, size_t len) {
+        if (!capture) return;
+        timeval tv;
+        gettimeofday(&tv, nullptr);
+        pcap_record_header rec = {(uint32_t)tv.tv_sec, (uint32_t)tv.tv_usec, (uint32_t)len, (uint32_t)len};
+        fwrite(&rec, sizeof(rec), 1, capture);
+        fwrite(frame, 1, len, capture);
+    }
+private:
+    struct pcap_file_header {
+        uint32_t magic;
+        uint16_t version_major;
+        uint16_t version_minor;
+        int32_t thiszone;
+        uint32_t sigfigs;
+        uint32_t snaplen;
+        uint32_t linktype;
+    };
+    struct pcap_record_header {
+        uint32_t ts_sec;
+        uint32_t ts_usec;
+        uint32_t incl_len;
+        uint32_t orig_len;
+    };
+    FILE *replay;
+    FILE *capture;
+    std::atomic<bool> running;
+    std::thread rx_thread;
+};
+
+#endif
@@ -2,6 +2,7 @@
 #define NSCSCC_CONFREG
 
 #include "mmio_dev.hpp"
+#include "event_queue.hpp"
 #include <cstring>
 #include <cassert>
 #include <queue>
@@ -35,8 +36,8 @@
 // physical address = [0x1faf0000,0x1fafffff]
 class nscscc_confreg : public mmio_dev {
 public:
-    nscscc_confreg(bool simulation = false) {
-        timer = 0;
+    nscscc_confreg(event_queue &events, bool simulation = false):events(events) {
+        timer_base = events.now();
         memset(cr,0,sizeof(cr));
         led = 0;
         led_rg0 = 0;
@@ -49,9 +50,6 @@ public:
         virtual_uart = 0;
         set_switch(0);
     }
-    void tick() {
-        timer ++;
-    }
     bool do_read(uint64_t start_addr, uint64_t size, char* buffer) {
         assert(size == 4);
         switch (start_addr) {
@@ -104,7 +102,7 @@ public:
                 *(unsigned int *)buffer = switch_inter_data;
                 break;
             case TIMER_ADDR:
-                *(unsigned int *)buffer = timer;
+                *(unsigned int *)buffer = events.now() - timer_base;
                 break;
             case SIMU_FLAG_ADDR:
                 *(unsigned int *)buffer = simu_flag;
@@ -155,7 +153,7 @@ public:
                 cr[7] = *(unsigned int*)buffer;
                 break;
             case TIMER_ADDR:
-                timer = *(unsigned int*)buffer;
+                timer_base = events.now() - *(unsigned int*)buffer;
                 break;
             case IO_SIMU_ADDR:
                 io_simu = (((*(unsigned int*)buffer) & 0xffff) << 16) | ((*(unsigned int*)buffer) >> 16);
@@ -231,7 +229,8 @@ private:
     uint32_t cr[8];
     unsigned int switch_data;
     unsigned int switch_inter_data;
-    unsigned int timer;
+    event_queue &events;
+    uint64_t timer_base; // timer counts the shared virtual time
     unsigned int led;
     unsigned int led_rg0;
     unsigned int led_rg1;
@@ -2,16 +2,22 @@
 #define RV_CLINT_HPP
 
 #include "mmio_dev.hpp"
+#include "event_queue.hpp"
 #include <cstdint>
+#include <cstring>
+#include <cassert>
 
 template <unsigned int nr_hart=1>
 class rv_clint : public mmio_dev {
 public:
-    rv_clint() {
-        mtime = 0;
-        for (int i=0;i<nr_hart;i++) {
+    rv_clint(event_queue &events):events(events) {
+        mtime_base = events.now();
+        for (unsigned int i=0;i<nr_hart;i++) {
             mtimecmp[i] = 0;
             msip[i] = 0;
+            mtip[i] = false;
+            timer_id[i] = events.add_timer([this, i]() { mtip[i] = true; });
+            update_timer(i);
         }
     }
     bool do_read(uint64_t start_addr, uint64_t size, char* buffer) {
@@ -19,6 +25,7 @@ public:
             // mtimecmp, mtime
             if (start_addr >= 0xbff8 && start_addr + size <= 0xc000) {
                 // mtime
+                uint64_t mtime = get_mtime();
                 memcpy(buffer,((char*)(&mtime))+start_addr-0xbff8,size);
                 // printf("read mtime\n");
             }
@@ -43,11 +50,15 @@ public:
             // mtimecmp, mtime
             if (start_addr >= 0xbff8 && start_addr + size <= 0xc000) {
                 // mtime
+                uint64_t mtime = get_mtime();
                 memcpy(((char*)(&mtime))+start_addr-0xbff8,buffer,size);
+                mtime_base = events.now() - mtime;
+                for (unsigned int i=0;i<nr_hart;i++) update_timer(i);
                 // printf("write mtime\n");
             }
             else if (start_addr >= 0x4000 && start_addr + size <= 0x4000 + 8 * nr_hart) {
                 memcpy(((char*)(&mtimecmp))+start_addr-0x4000,buffer,size);
+                for (uint64_t i=(start_addr-0x4000)/8;i<=(start_addr+size-1-0x4000)/8;i++) update_timer(i);
                 // printf("write mtimecmp %lx mtime %lx size %d diff %lx\n",mtimecmp[0],mtime,(int)size,mtimecmp[0]-mtime);
             }
             else return false;
@@ -56,7 +67,7 @@ public:
             // msip
             if (start_addr+size <= 4*nr_hart) {
                 memcpy(((char*)(&msip))+start_addr,buffer,size);
-                for (int i=0;i<nr_hart;i++) msip[i] &= 1;
+                for (unsigned int i=0;i<nr_hart;i++) msip[i] &= 1;
                 // printf("write msip[0] %x\n",msip[0]);
                 // printf("write msip[0] %x\n",msip[1]);
             }
@@ -64,24 +75,41 @@ public:
         }
         return true;
     }
-    void tick() {
-        mtime ++;
-    }
     bool m_s_irq(unsigned int hart_id) { // machine software irq
         if (hart_id >= nr_hart) assert(false);
         else return (msip[hart_id] & 1);
     }
     bool m_t_irq(unsigned int hart_id) { // machine timer irq
         if (hart_id >= nr_hart) assert(false);
-        else return mtime > mtimecmp[hart_id];
+        else return mtip[hart_id];
     }
-    void set_cmp(uint64_t new_val) {
-        mtimecmp = new_val;
+    void serialize(checkpoint &cp) {
+        cp.section("rv_clint");
+        cp.io(mtime_base);
+        cp.io(mtimecmp);
+        cp.io(msip);
+        if (!cp.saving()) for (unsigned int i=0;i<nr_hart;i++) update_timer(i);
     }
 private:
-    uint64_t mtime;
+    // mtime counts the shared virtual time from mtime_base.
+    uint64_t get_mtime() {
+        return events.now() - mtime_base;
+    }
+    // Raise mtip now if mtime > mtimecmp, otherwise schedule it for when mtime passes mtimecmp.
+    void update_timer(unsigned int hart_id) {
+        uint64_t mtime = get_mtime();
+        events.cancel(timer_id[hart_id]);
+        mtip[hart_id] = mtime > mtimecmp[hart_id];
+        if (!mtip[hart_id] && mtimecmp[hart_id] != UINT64_MAX) {
+            events.schedule(timer_id[hart_id], events.now() + (mtimecmp[hart_id] - mtime) + 1);
+        }
+    }
+    event_queue &events;
+    uint64_t mtime_base;
     uint64_t mtimecmp[nr_hart];
     uint32_t msip[nr_hart];
+    bool mtip[nr_hart];
+    int timer_id[nr_hart];
 };
 
 #endif
\ No newline at end of file
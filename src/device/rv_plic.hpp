@@ -2,46 +2,82 @@
 #define RV_PLIC_HPP
 
 #include "mmio_dev.hpp"
+#include "irq_line.hpp"
+#include "checkpoint.hpp"
 #include <cstring>
 #include <climits>
-#include <bitset>
+#include <cassert>
+#include <algorithm>
+#include <atomic>
 
 // We need 2 context corresponding to meip and seip per hart.
-template <int nr_source = 1, int nr_context = 2>
-class rv_plic : public mmio_dev {
+// The spec allows up to 1023 sources and 15872 contexts.
+template <int nr_source = 1, int nr_context = 2, int max_priority = 7>
+class rv_plic : public mmio_dev, public irq_sink {
+    static_assert(nr_source >= 1 && nr_source <= 1023, "PLIC supports 1 to 1023 sources");
+    static_assert(nr_context >= 1 && nr_context <= 15872, "PLIC supports 1 to 15872 contexts");
 public:
     rv_plic() {
-        for (int i=0;i<(nr_source+1);i++) {
-            priority[i] = 0;
+        memset(priority,0,sizeof(priority));
+        memset(prio_mask,0,sizeof(prio_mask));
+        memset(pending,0,sizeof(pending));
+        memset(claimed,0,sizeof(claimed));
+        memset(enable,0,sizeof(enable));
+        memset(threshold,0,sizeof(threshold));
+        memset(claim,0,sizeof(claim));
+        generation = 0;
+        for (int i=0;i<nr_context;i++) cached_generation[i] = UINT64_MAX;
+        for (int i=0;i<nr_word;i++) {
+            lines[i] = 0;
+            raised[i] = 0;
         }
-        for (int i=0;i<((nr_source+1+31)/32);i++) {
-            pending[i] = 0;
-            claimed[i] = 0;
-        }
-        for (int i=0;i<nr_context;i++) {
-            for (int j=0;j<((nr_source+1+31)/32);j++) enable[i][j] = 0;
-            threshold[i] = 0;
-            claim[i] = 0;
+        line_raised = false;
+    }
+    // Level of an interrupt line pushed by a device, may be called from any thread.
+    // Rising edges are latched and merged into pending by the next get_int().
+    void set_irq(unsigned int source_id, bool level) {
+        if (source_id == 0 || source_id > nr_source) return;
+        uint64_t bit = 1ull << (source_id % 64);
+        if (level) {
+            lines[source_id/64].fetch_or(bit, std::memory_order_relaxed);
+            raised[source_id/64].fetch_or(bit);
+            line_raised = true;
         }
+        else lines[source_id/64].fetch_and(~bit, std::memory_order_relaxed);
     }
     void update_ext(int source_id, bool fired) {
-        if (fired) pending[source_id/32] |= 1u << (source_id % 32);
+        uint64_t bit = 1ull << (source_id % 64);
+        if (fired && !(pending[source_id/64] & bit)) {
+            pending[source_id/64] |= bit;
+            generation ++;
+        }
     }
     bool get_int(int context_id) {
-        uint64_t max_priority = 0;
-        uint64_t max_priority_int = 0;
-        for (int i=1;i<=nr_source;i++) {
-            if (priority[i] >= threshold[context_id] && ((pending[i/32]>>(i%32))&1) && ((enable[context_id][i/32]>>(i%32))&1) && !((claimed[i/32]>>(i%32))&1)) {
-                if (priority[i] > max_priority) {
-                    max_priority = priority[i];
-                    max_priority_int = i;
-                }
-            }
+        if (line_raised.load(std::memory_order_relaxed)) merge_lines();
+        if (cached_generation[context_id] != generation) {
+            claim[context_id] = arbitrate(context_id);
+            cached_generation[context_id] = generation;
         }
-        if (max_priority_int) claim[context_id] = max_priority_int;
-        else claim[context_id] = 0;
         return claim[context_id] != 0;
     }
+    void serialize(checkpoint &cp) {
+        cp.section("rv_plic");
+        cp.io(priority);
+        cp.io(prio_mask);
+        cp.io(pending);
+        cp.io(claimed);
+        cp.io(enable);
+        cp.io(threshold);
+        for (int i=0;i<nr_word;i++) {
+            cp.io(lines[i]);
+            cp.io(raised[i]);
+        }
+        cp.io(line_raised);
+        if (!cp.saving()) {
+            generation ++;
+            for (int i=0;i<nr_context;i++) cached_generation[i] = UINT64_MAX;
+        }
+    }
     bool do_read(uint64_t start_addr, uint64_t size, char* buffer) {
         assert(size == 4);
         if (start_addr + size <= 0x1000) { // [0x4,0x1000] interrupt source priority
@@ -52,8 +88,8 @@ public:
         }
         else if (start_addr + size <= 0x1080) { // [0x1000,0x1080] interrupt pending bits
             uint64_t idx = (start_addr - 0x1000) / 4;
-            if (idx > nr_source) return false;
-            *((uint32_t*)buffer) = pending[idx];
+            if (idx >= nr_word32) return false;
+            *((uint32_t*)buffer) = pending[idx/2] >> (32 * (idx % 2));
             return true;
         }
         else if (start_addr + size <= 0x2000) {
@@ -61,23 +97,28 @@ public:
         }
         else if (start_addr + size <= 0x200000) { // enable bits for sources on context
             uint64_t context_id = (start_addr - 0x2000) / 0x80;
-            uint64_t pos = start_addr % 0x80;
+            uint64_t idx = (start_addr % 0x80) / 4;
             if (context_id >= nr_context) return false;
-            if (pos > nr_source) return false;
-            *((uint32_t*)buffer) = enable[context_id][pos];
+            if (idx >= nr_word32) return false;
+            *((uint32_t*)buffer) = enable[context_id][idx/2] >> (32 * (idx % 2));
             return true;
         }
         else { // priority threshold and claim/complete
             uint64_t context_id = (start_addr - 0x200000) / 0x1000;
-            if (context_id > nr_context) return false;
+            if (context_id >= nr_context) return false;
             uint64_t offset = start_addr % 0x1000;
             if (offset == 0) { // priority threshold
                 *((uint32_t*)buffer) = threshold[context_id];
                 return true;
             }
             else if (offset == 4) { // claim/complete
-                (*((uint32_t*)buffer)) = claim[context_id];
-                claimed[claim[context_id]/32] |= 1u << (claim[context_id]%32);
+                get_int(context_id);
+                uint32_t id = claim[context_id];
+                (*((uint32_t*)buffer)) = id;
+                if (id) {
+                    claimed[id/64] |= 1ull << (id % 64);
+                    generation ++;
+                }
                 return true;
             }
             else return false;
@@ -88,7 +129,7 @@ public:
         if (start_addr + size <= 0x1000) { // [0x4,0x1000] interrupt source priority
             if (start_addr == 0) return false;
             if (start_addr > 4 * nr_source || start_addr + size > 4 * (nr_source + 1)) return false;
-            priority[start_addr/4] = *((uint32_t*)buffer);
+            set_priority(start_addr/4, *((uint32_t*)buffer));
             return true;
         }
         else if (start_addr + size <= 0x1080) { // [0x1000,0x1080] interrupt pending bits
@@ -99,23 +140,34 @@ public:
         }
         else if (start_addr + size <= 0x200000) { // enable bits for sources on context
             uint64_t context_id = (start_addr - 0x2000) / 0x80;
-            uint64_t pos = start_addr % 0x80;
+            uint64_t idx = (start_addr % 0x80) / 4;
             if (context_id >= nr_context) return false;
-            if (pos > nr_source) return false;
-            enable[context_id][pos] = *((uint32_t*)buffer);
+            if (idx >= nr_word32) return false;
+            uint64_t value = *((uint32_t*)buffer);
+            uint64_t shift = 32 * (idx % 2);
+            uint64_t &word = enable[context_id][idx/2];
+            word = (word & ~(0xffffffffull << shift)) | (value << shift);
+            word &= valid_mask(idx/2);
+            cached_generation[context_id] = UINT64_MAX;
             return true;
         }
         else { // priority threshold and claim/complete
             uint64_t context_id = (start_addr - 0x200000) / 0x1000;
-            if (context_id > nr_context) return false;
+            if (context_id >= nr_context) return false;
             uint64_t offset = start_addr % 0x1000;
             if (offset == 0) { // priority threshold
                 threshold[context_id] = *((uint32_t*)buffer);
+                cached_generation[context_id] = UINT64_MAX;
                 return true;
             }
             else if (offset == 4) { // claim/complete
-                claimed[(*((uint32_t*)buffer))/32] &= ~(1u << ((*((uint32_t*)buffer)%32)));
-                pending[(*((uint32_t*)buffer))/32] &= ~(1u << ((*((uint32_t*)buffer)%32)));
+                uint32_t id = *((uint32_t*)buffer);
+                if (id == 0 || id > nr_source) return true;
+                claimed[id/64] &= ~(1ull << (id % 64));
+                pending[id/64] &= ~(1ull << (id % 64));
+                // the gateway forwards a new request if the line is still asserted
+                pending[id/64] |= lines[id/64].load(std::memory_order_relaxed) & (1ull << (id % 64));
+                generation ++;
                 return true;
             }
             else return false;
@@ -123,13 +175,65 @@ public:
         return true;
     }
 private:
-    // source 0 is reserved.
+    static const int nr_word = (nr_source + 1 + 63) / 64;
+    static const int nr_word32 = (nr_source + 1 + 31) / 32;
+    // Bits of word that belong to implemented sources, source 0 is reserved.
+    static uint64_t valid_mask(int word) {
+        uint64_t mask = UINT64_MAX;
+        if (word == 0) mask &= ~1ull;
+        if (word == nr_word - 1 && (nr_source + 1) % 64) mask &= (1ull << ((nr_source + 1) % 64)) - 1;
+        return mask;
+    }
+    void set_priority(int source_id, uint32_t value) {
+        value = std::min(value, (uint32_t)max_priority);
+        prio_mask[priority[source_id]][source_id/64] &= ~(1ull << (source_id % 64));
+        prio_mask[value][source_id/64] |= 1ull << (source_id % 64);
+        priority[source_id] = value;
+        generation ++;
+    }
+    void merge_lines() {
+        line_raised = false;
+        for (int w=0;w<nr_word;w++) {
+            uint64_t bits = raised[w].exchange(0);
+            if (bits & ~pending[w]) {
+                pending[w] |= bits;
+                generation ++;
+            }
+        }
+    }
+    // Highest priority pending, enabled and unclaimed source with priority >= threshold, lowest id wins ties.
+    uint32_t arbitrate(int context_id) {
+        uint64_t candidate[nr_word];
+        bool any = false;
+        for (int w=0;w<nr_word;w++) {
+            candidate[w] = pending[w] & ~claimed[w] & enable[context_id][w];
+            any |= candidate[w] != 0;
+        }
+        if (!any) return 0;
+        uint32_t min_level = std::max(threshold[context_id], 1u);
+        if (min_level > max_priority) return 0;
+        for (int level=max_priority;level>=(int)min_level;level--) {
+            for (int w=0;w<nr_word;w++) {
+                uint64_t bits = candidate[w] & prio_mask[level][w];
+                if (bits) return w * 64 + __builtin_ctzll(bits);
+            }
+        }
+        return 0;
+    }
     uint32_t priority[nr_source+1];
-    uint32_t pending[(nr_source+1+31)/32];
-    uint32_t enable[nr_context][(nr_source+1+31)/32];
+    uint64_t prio_mask[max_priority+1][nr_word]; // sources grouped by priority level
+    uint64_t pending[nr_word];
+    uint64_t claimed[nr_word];
+    uint64_t enable[nr_context][nr_word];
     uint32_t threshold[nr_context];
     uint32_t claim[nr_context];
-    uint32_t claimed[(nr_source+1+31)/32];
+    // pushed by irq_line, possibly from other threads
+    std::atomic<uint64_t> lines[nr_word];
+    std::atomic<uint64_t> raised[nr_word];
+    std::atomic<bool> line_raised;
+    // get_int() results are cached until the inputs of the context change.
+    uint64_t generation;
+    uint64_t cached_generation[nr_context];
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,89 @@
+#ifndef SPSC_RING_HPP
+#define SPSC_RING_HPP
+
+#include <cstddef>
+#include <atomic>
+#include <algorithm>
+#include "checkpoint.hpp"
+
+// Fixed capacity lock-free ring between exactly one producer thread and one consumer thread.
+// push() and producer-side queries belong to the producer, front(), pop() and clear() to the consumer.
+template <typename T, size_t capacity>
+class spsc_ring {
+    static_assert(capacity >= 2 && (capacity & (capacity - 1)) == 0, "capacity must be a power of 2");
+public:
+    spsc_ring() {
+        head = 0;
+        tail = 0;
+    }
+    bool push(const T &value) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == capacity) return false;
+        buffer[t % capacity] = value;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+    // Push as many of the n values as fit, returns how many were pushed.
+    size_t push(const T *values, size_t n) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        n = std::min(n, capacity - (t - head.load(std::memory_order_acquire)));
+        for (size_t i=0;i<n;i++) buffer[(t + i) % capacity] = values[i];
+        tail.store(t + n, std::memory_order_release);
+        return n;
+    }
+    bool front(T &value) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) return false;
+        value = buffer[h % capacity];
+        return true;
+    }
+    bool pop(T &value) {
+        if (!front(value)) return false;
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        return true;
+    }
+    // Pop up to n values, returns how many were popped.
+    size_t pop(T *values, size_t n) {
+        size_t h = head.load(std::memory_order_relaxed);
+        n = std::min(n, tail.load(std::memory_order_acquire) - h);
+        for (size_t i=0;i<n;i++) values[i] = buffer[(h + i) % capacity];
+        head.store(h + n, std::memory_order_release);
+        return n;
+    }
+    bool pop() {
+        T value;
+        return pop(value);
+    }
+    void clear() {
+        head.store(tail.load(std::memory_order_acquire), std::memory_order_release);
+    }
+    bool empty() {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+    bool full() {
+        return size() == capacity;
+    }
+    size_t size() {
+        size_t h = head.load(std::memory_order_acquire);
+        return tail.load(std::memory_order_acquire) - h;
+    }
+    // Queued values, neither side may run meanwhile.
+    void serialize(checkpoint &cp) {
+        size_t h = head, n = tail - h;
+        cp.io(n);
+        if (!cp.saving()) {
+            if (n > capacity) n = 0;
+            h = 0;
+            head = 0;
+            tail = n;
+        }
+        for (size_t i=0;i<n;i++) cp.io(buffer[(h + i) % capacity]);
+    }
+private:
+    // head and tail live on their own cache lines so the two threads do not share a line
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+    alignas(64) T buffer[capacity];
+};
+
+#endif
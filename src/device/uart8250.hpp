@@ -2,9 +2,13 @@
 #define UART8250_HPP
 
 #include "mmio_dev.hpp"
-#include <mutex>
-#include <queue>
-#include <assert.h>
+#include "irq_line.hpp"
+#include "spsc_ring.hpp"
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <cstring>
+#include <cstdio>
 
 #define UART8250_TX_RX_DLL  0
 #define UART8250_IER_DLM    1
@@ -20,10 +24,31 @@
 #define UART8250_IER_LSRC   4   // Receiver line status register chagne
 #define UART8250_IER_MSRC   8   // Modem status register change
 
+#define UART8250_FCR_ENABLE     1   // Enable FIFOs
+#define UART8250_FCR_CLEAR_RX   2
+#define UART8250_FCR_CLEAR_TX   4
+
+#define UART8250_IIR_NO_INT     1
+#define UART8250_IIR_THRI       2   // Transmitter holding register empty
+#define UART8250_IIR_RDI        4   // Receiver data available (trigger level reached)
+#define UART8250_IIR_CTI        12  // Character timeout
+#define UART8250_IIR_FIFO       (3 << 6)
+
+#define UART8250_LSR_DR         1
+#define UART8250_LSR_THRE       (1 << 5)
+#define UART8250_LSR_TEMT       (1 << 6)
+
+// 16550A with 16 byte FIFOs and RX trigger levels.
+// The guest visible FIFOs are the fronts of the host rings, so host input is never overrun.
+// The character timeout is raised once a burst of host input ends below the trigger level.
+
 class uart8250 : public mmio_dev {
 public:
     uart8250() {
         thr_empty = false;
+        tx_reset = false;
+        rx_idle = true;
+        FCR = 0;
         DLL = 0;
         DLM = 0;
         IER = 0;
@@ -32,8 +57,9 @@ public:
         MCR = 0;
     }
     bool do_read(uint64_t start_addr, uint64_t size, char* buffer) {
-        std::unique_lock<std::mutex> lock(rx_lock);
-        assert(size == 1);
+        // wider accesses see the byte register zero extended
+        if (size > 4) return false;
+        memset(buffer, 0, size);
         switch (start_addr) {
             case UART8250_TX_RX_DLL: {
                 if (DLAB()) {
@@ -42,10 +68,8 @@ public:
                 }
                 else {
                     // RX
-                    if (!rx.empty()) {
-                        *buffer = rx.front();
-                        rx.pop();
-                    }
+                    char c;
+                    if (rx.pop(c)) *buffer = c;
                 }
                 break;
             }
@@ -61,10 +85,10 @@ public:
                 break;
             }
             case UART8250_IIR_FCR: {
-                // IIR
+                // IIR, reading it acknowledges a THRE interrupt
                 update_IIR();
                 *buffer = IIR;
-                thr_empty = false;
+                if ((IIR & 0xf) == UART8250_IIR_THRI) thr_empty = false;
                 break;
             }
             case UART8250_LCR: {
@@ -76,7 +100,9 @@ public:
                 break;
             }
             case UART8250_LSR: {
-                *buffer = (!rx.empty()) | (1<<5) | (1<<6);
+                // the host ring accepts a full FIFO load while at least fifo_size bytes are free
+                bool tx_ready = tx.size() + fifo_size <= tx_capacity;
+                *buffer = (!rx.empty() ? UART8250_LSR_DR : 0) | (tx_ready ? UART8250_LSR_THRE | UART8250_LSR_TEMT : 0);
                 break;
             }
             case UART8250_MSR: {
@@ -90,21 +116,21 @@ public:
                 break;
             }
             default:
-                assert(false);
+                return false;
         }
+        update_irq();
         return true;
     }
     bool do_write(uint64_t start_addr, uint64_t size, const char* buffer) {
-        std::unique_lock<std::mutex> lock_tx(tx_lock);
-        std::unique_lock<std::mutex> lock_rx(rx_lock);
-        assert(size == 1);
+        if (size > 4) return false;
         switch (start_addr) {
             case UART8250_TX_RX_DLL: {
                 if (DLAB()) {
                     DLL = *buffer;
                 }
                 else {
-                    tx.push(static_cast<char>(*buffer));
+                    tx.push(static_cast<char>(*buffer)); // dropped if the FIFO is full
+                    if (tx_notify) tx_notify();
                     thr_empty = false;
                 }
                 break;
@@ -119,12 +145,13 @@ public:
                 break;
             }
             case UART8250_IIR_FCR: {
-                // FCR allow clear FIFO
-                if ( (*buffer) & (1 << 1)) {
-                    while (!rx.empty()) rx.pop();
+                FCR = *buffer & 0xc1;
+                if ( (*buffer) & UART8250_FCR_CLEAR_RX) {
+                    rx.clear();
                 }
-                if ( (*buffer) & (1 << 2)) {
-                    while (!tx.empty()) tx.pop();
+                if ( (*buffer) & UART8250_FCR_CLEAR_TX) {
+                    // only the consumer may drop tx entries, ask it to
+                    tx_reset = true;
                 }
                 break;
             }
@@ -149,63 +176,121 @@ public:
                 break;
             }
             default:
-                assert(false);
+                return false;
         }
+        update_irq();
         return true;
     }
+    // Host input, blocks while the rx FIFO is full. A burst of bytes raises at most
+    // one interrupt per trigger level plus a character timeout at its end.
+    void putc(const char *buf, size_t len) {
+        rx_idle = false;
+        for (size_t i=0;i<len;i++) {
+            while (!rx.push(buf[i])) std::this_thread::yield();
+            if (rx.size() >= rx_trigger()) update_irq();
+        }
+        rx_idle = true;
+        update_irq();
+    }
     void putc(char c) {
-        std::unique_lock<std::mutex> lock(rx_lock);
-        rx.push(c);
+        putc(&c, 1);
     }
     char getc() {
-        std::unique_lock<std::mutex> lock(tx_lock);
-        if (!tx.empty()) {
-            char res = tx.front();
-            tx.pop();
-            if (tx.empty()) thr_empty = true;
+        char res;
+        if (tx_reset.exchange(false)) tx.clear();
+        if (tx.pop(res)) {
+            if (tx.empty()) {
+                thr_empty = true;
+                update_irq();
+            }
             return res;
         }
         else return EOF;
     }
     bool irq() {
-        update_IIR();
-        return !(IIR & 1);
+        return ((IER & UART8250_IER_THRE) && thr_empty) || ((IER & UART8250_IER_RDA) && rx_ready());
     }
     bool exist_tx() {
-        std::unique_lock<std::mutex> lock(tx_lock);
+        if (tx_reset.exchange(false)) tx.clear();
         return !tx.empty();
     }
+    // Called on the emulation thread whenever the guest queues a TX byte.
+    void set_tx_notify(std::function<void()> notify) {
+        tx_notify = notify;
+    }
+    void connect_irq(irq_sink *sink, unsigned int id) {
+        irq_out.connect(sink, id);
+        update_irq();
+    }
+    void serialize(checkpoint &cp) {
+        cp.section("uart8250");
+        rx.serialize(cp);
+        tx.serialize(cp);
+        cp.io(tx_reset);
+        cp.io(rx_idle);
+        cp.io(thr_empty);
+        cp.io(DLL);
+        cp.io(DLM);
+        cp.io(IER);
+        cp.io(LCR);
+        cp.io(IIR);
+        cp.io(FCR);
+        cp.io(MCR);
+        if (!cp.saving()) update_irq();
+    }
 private:
+    // Called from both the emulation and host threads, re-check so a racing update is not lost.
+    void update_irq() {
+        while (true) {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            bool level = irq();
+            irq_out.set(level);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (irq() == level) break;
+        }
+    }
+    irq_line irq_out;
+    std::function<void()> tx_notify;
     bool DLAB() {
         return (LCR >> 7) != 0;
     }
+    // RX trigger level from FCR[7:6], every byte interrupts with the FIFOs disabled.
+    size_t rx_trigger() {
+        static const size_t levels[4] = {1, 4, 8, 14};
+        unsigned char fcr = FCR;
+        return (fcr & UART8250_FCR_ENABLE) ? levels[fcr >> 6] : 1;
+    }
+    bool rx_ready() {
+        size_t count = rx.size();
+        return count && (count >= rx_trigger() || rx_idle);
+    }
     void update_IIR() {
-        IIR = 3 << 6; // FIFO Enabled
-        bool no_int = true;
-        if ( (IER & UART8250_IER_THRE) && thr_empty) {
-            IIR |= (1<<1);
-            no_int = false;
+        IIR = (FCR & UART8250_FCR_ENABLE) ? UART8250_IIR_FIFO : 0;
+        if ( (IER & UART8250_IER_RDA) && rx_ready()) {
+            IIR |= rx.size() >= rx_trigger() ? UART8250_IIR_RDI : UART8250_IIR_CTI;
         }
-        if ( (IER & UART8250_IER_RDA) && !rx.empty()) {
-            IIR |= (2<<1);
-            no_int = false;
+        else if ( (IER & UART8250_IER_THRE) && thr_empty) {
+            IIR |= UART8250_IIR_THRI;
         }
-        IIR |= no_int;
+        else IIR |= UART8250_IIR_NO_INT;
     }
     const static uint64_t UART_RX = 0;
     const static uint64_t UART_TX = 0;
-    std::queue <char> rx;
-    std::queue <char> tx;
-    std::mutex rx_lock;
-    std::mutex tx_lock;
+    const static size_t fifo_size = 16;
+    const static size_t tx_capacity = 1024;
+    spsc_ring<char, 1024> rx; // host input thread -> guest
+    spsc_ring<char, tx_capacity> tx; // guest -> host console
+    std::atomic<bool> tx_reset;
+    std::atomic<bool> rx_idle; // no host input burst in progress
 
-    bool thr_empty;
+    std::atomic<bool> thr_empty;
     // regs
     unsigned char DLL;
     unsigned char DLM;
-    unsigned char IER;
+    std::atomic<unsigned char> IER; // read by irq() on host threads
     unsigned char LCR;
     unsigned char IIR;
+    std::atomic<unsigned char> FCR; // read by irq() on host threads
     unsigned char MCR;
 };
 
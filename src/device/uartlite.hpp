@@ -2,10 +2,14 @@
 #define UARTLITE_HPP
 
 #include "mmio_dev.hpp"
+#include "irq_line.hpp"
+#include "spsc_ring.hpp"
 #include <algorithm>
-#include <queue>
-#include <mutex>
+#include <atomic>
+#include <functional>
+#include <thread>
 #include <cstring>
+#include <cstdio>
 
 #define SR_TX_FIFO_FULL         (1<<3) /* transmit FIFO full */
 #define SR_TX_FIFO_EMPTY        (1<<2) /* transmit FIFO empty */
@@ -28,69 +32,119 @@ public:
         memset(&regs,0,sizeof(regs));
         regs.status = SR_TX_FIFO_EMPTY;
         wait_ack = false;
+        tx_reset = false;
     }
     bool do_read(uint64_t start_addr, uint64_t size, char* buffer) {
-        std::unique_lock<std::mutex> lock(rx_lock);
         if (start_addr + size > sizeof(regs)) return false;
-        if (!rx.empty()) {
+        char c;
+        if (rx.front(c)) {
             regs.status |= SR_RX_FIFO_VALID_DATA;
-            regs.rx_fifo = rx.front();
+            regs.rx_fifo = c;
         }
         else regs.status &= ~SR_RX_FIFO_VALID_DATA;
+        if (rx.full()) regs.status |= SR_RX_FIFO_FULL;
+        else regs.status &= ~SR_RX_FIFO_FULL;
+        if (tx.empty()) regs.status |= SR_TX_FIFO_EMPTY;
+        else regs.status &= ~SR_TX_FIFO_EMPTY;
+        if (tx.full()) regs.status |= SR_TX_FIFO_FULL;
+        else regs.status &= ~SR_TX_FIFO_FULL;
         memcpy(buffer,((char*)(&regs))+start_addr,std::min(size,sizeof(regs)-start_addr));
         wait_ack = false;
         if (start_addr <= offsetof(uartlite_regs,rx_fifo) && offsetof(uartlite_regs,rx_fifo) <= start_addr + size) {
-            if (!rx.empty()) rx.pop();
+            rx.pop();
         }
+        update_irq();
         return true;
     }
     bool do_write(uint64_t start_addr, uint64_t size, const char* buffer) {
-        std::unique_lock<std::mutex> lock_tx(tx_lock);
-        std::unique_lock<std::mutex> lock_rx(rx_lock);
         if (start_addr + size > sizeof(regs)) return false;
         memcpy(((char*)(&regs))+start_addr,buffer,std::min(size,sizeof(regs)-start_addr));
         if (start_addr <= offsetof(uartlite_regs,tx_fifo) && offsetof(uartlite_regs,tx_fifo) <= start_addr + size) {
-            tx.push(static_cast<char>(regs.tx_fifo));
+            tx.push(static_cast<char>(regs.tx_fifo)); // dropped if the FIFO is full
+            if (tx_notify) tx_notify();
         }
         if (start_addr <= offsetof(uartlite_regs,control) && offsetof(uartlite_regs,control) <= start_addr + size) {
             if (regs.control & ULITE_CONTROL_RST_TX) {
-                while (!tx.empty()) tx.pop();
+                // only the consumer may drop tx entries, ask it to
+                tx_reset = true;
             }
             if (regs.control & ULITE_CONTROL_RST_RX) {
-                while (!rx.empty()) rx.pop();
+                rx.clear();
             }
         }
+        update_irq();
         return true;
     }
+    // Host input, blocks while the rx FIFO is full.
+    void putc(const char *buf, size_t len) {
+        for (size_t i=0;i<len;i++) {
+            while (!rx.push(buf[i])) std::this_thread::yield();
+        }
+        update_irq();
+    }
     void putc(char c) {
-        std::unique_lock<std::mutex> lock(rx_lock);
-        rx.push(c);
+        putc(&c, 1);
+    }
+    // Host input without blocking, for the emulation thread. Returns how many bytes fit in the rx FIFO.
+    size_t try_putc(const char *buf, size_t len) {
+        size_t n = rx.push(buf, len);
+        update_irq();
+        return n;
     }
     char getc() {
-        std::unique_lock<std::mutex> lock(tx_lock);
-        if (!tx.empty()) {
-            char res = tx.front();
-            tx.pop();
-            if (tx.empty()) wait_ack = true;
+        char res;
+        if (tx_reset.exchange(false)) tx.clear();
+        if (tx.pop(res)) {
+            if (tx.empty()) {
+                wait_ack = true;
+                update_irq();
+            }
             return res;
         }
         else return EOF;
     }
     bool exist_tx() {
-        std::unique_lock<std::mutex> lock(tx_lock);
+        if (tx_reset.exchange(false)) tx.clear();
         return !tx.empty();
     }
     bool irq() {
-        std::unique_lock<std::mutex> lock(rx_lock);
         return !rx.empty() || wait_ack;
     }
+    // Called on the emulation thread whenever the guest queues a TX byte.
+    void set_tx_notify(std::function<void()> notify) {
+        tx_notify = notify;
+    }
+    void connect_irq(irq_sink *sink, unsigned int id) {
+        irq_out.connect(sink, id);
+        update_irq();
+    }
+    void serialize(checkpoint &cp) {
+        cp.section("uartlite");
+        cp.io(regs);
+        rx.serialize(cp);
+        tx.serialize(cp);
+        cp.io(wait_ack);
+        cp.io(tx_reset);
+        if (!cp.saving()) update_irq();
+    }
 private:
+    // Called from both the emulation and host threads, re-check so a racing update is not lost.
+    void update_irq() {
+        while (true) {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            bool level = irq();
+            irq_out.set(level);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (irq() == level) break;
+        }
+    }
+    irq_line irq_out;
+    std::function<void()> tx_notify;
     uartlite_regs regs;
-    std::queue <char> rx;
-    std::queue <char> tx;
-    std::mutex rx_lock;
-    std::mutex tx_lock;
-    bool wait_ack;
+    spsc_ring<char, 1024> rx; // host input thread -> guest
+    spsc_ring<char, 1024> tx; // guest -> host console
+    std::atomic<bool> wait_ack;
+    std::atomic<bool> tx_reset;
 };
 
 #endif
\ No newline at end of file
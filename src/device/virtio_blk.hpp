@@ -0,0 +1,130 @@
+#ifndef VIRTIO_BLK_HPP
+#define VIRTIO_BLK_HPP
+
+#include "virtio_mmio.hpp"
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define VIRTIO_ID_BLOCK         2
+
+#define VIRTIO_BLK_F_RO         (1ull << 5)
+#define VIRTIO_BLK_F_FLUSH      (1ull << 9)
+
+#define VIRTIO_BLK_T_IN         0
+#define VIRTIO_BLK_T_OUT        1
+#define VIRTIO_BLK_T_FLUSH      4
+#define VIRTIO_BLK_T_GET_ID     8
+
+#define VIRTIO_BLK_S_OK         0
+#define VIRTIO_BLK_S_IOERR      1
+#define VIRTIO_BLK_S_UNSUPP     2
+
+// virtio block device backed by a memory-mapped disk image. Sectors are copied straight
+// between the host page cache and guest memory. With cow set, the image is mapped private
+// so guest writes stay in anonymous pages and the file is never modified.
+class virtio_blk : public virtio_mmio {
+public:
+    virtio_blk(mmio_dev &dma, const char *image, bool cow = false):virtio_mmio(VIRTIO_ID_BLOCK, dma, 1) {
+        disk = nullptr;
+        disk_size = 0;
+        read_only = false;
+        int fd = open(image, cow ? O_RDONLY : O_RDWR);
+        if (fd < 0 && !cow) {
+            fd = open(image, O_RDONLY);
+            read_only = true;
+        }
+        if (fd < 0) {
+            perror("virtio_blk: open");
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size >= 512) {
+            disk_size = st.st_size & ~511ull;
+            void *res = mmap(nullptr, disk_size, PROT_READ | (read_only ? 0 : PROT_WRITE), cow ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+            if (res == MAP_FAILED) {
+                perror("virtio_blk: mmap");
+                disk_size = 0;
+            }
+            else disk = (char*)res;
+        }
+        close(fd); // the mapping keeps the file referenced
+    }
+    ~virtio_blk() {
+        if (disk) munmap(disk, disk_size);
+    }
+    bool is_open() {
+        return disk != nullptr;
+    }
+protected:
+    uint64_t device_features() {
+        return (read_only ? VIRTIO_BLK_F_RO : 0) | VIRTIO_BLK_F_FLUSH;
+    }
+    bool config_read(uint64_t offset, uint64_t size, char* buffer) {
+        // struct virtio_blk_config, only capacity is provided
+        uint64_t capacity = disk_size / 512;
+        if (offset + size > 8) {
+            if (offset >= 8) {
+                memset(buffer, 0, size);
+                return true;
+            }
+            return false;
+        }
+        memcpy(buffer, (char*)&capacity + offset, size);
+        return true;
+    }
+    void queue_notify(unsigned int queue) {
+        uint16_t head;
+        while (queue_pop(queue, head, chain)) {
+            uint32_t written = 0;
+            uint8_t status = handle_request(written);
+            uint64_t status_offset = chain_size(chain, true) - 1;
+            if (chain_write(chain, status_offset, &status, 1) == 1) written ++;
+            queue_push(queue, head, written);
+        }
+    }
+private:
+    uint8_t handle_request(uint32_t &written) {
+        struct {
+            uint32_t type;
+            uint32_t reserved;
+            uint64_t sector;
+        } hdr;
+        uint64_t writable = chain_size(chain, true);
+        if (writable == 0 || chain_read(chain, 0, &hdr, sizeof(hdr)) != sizeof(hdr)) return VIRTIO_BLK_S_IOERR;
+        uint64_t offset = hdr.sector * 512;
+        switch (hdr.type) {
+            case VIRTIO_BLK_T_IN: {
+                uint64_t len = writable - 1;
+                if (hdr.sector > disk_size / 512 || len > disk_size - offset) return VIRTIO_BLK_S_IOERR;
+                written = chain_write(chain, 0, disk + offset, len);
+                return written == len ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR;
+            }
+            case VIRTIO_BLK_T_OUT: {
+                uint64_t len = chain_size(chain, false) - sizeof(hdr);
+                if (read_only) return VIRTIO_BLK_S_IOERR;
+                if (hdr.sector > disk_size / 512 || len > disk_size - offset) return VIRTIO_BLK_S_IOERR;
+                return chain_read(chain, sizeof(hdr), disk + offset, len) == len ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR;
+            }
+            case VIRTIO_BLK_T_FLUSH:
+                // private mappings have nothing to write back, msync on them is a no-op
+                if (disk && msync(disk, disk_size, MS_SYNC) != 0) return VIRTIO_BLK_S_IOERR;
+                return VIRTIO_BLK_S_OK;
+            case VIRTIO_BLK_T_GET_ID: {
+                char id[20] = "cemu-virtio-blk";
+                written = chain_write(chain, 0, id, std::min(writable - 1, (uint64_t)sizeof(id)));
+                return VIRTIO_BLK_S_OK;
+            }
+            default:
+                return VIRTIO_BLK_S_UNSUPP;
+        }
+    }
+    char *disk;
+    uint64_t disk_size;
+    bool read_only;
+    std::vector<virtq_buffer> chain;
+};
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef VIRTIO_CONSOLE_HPP
+#define VIRTIO_CONSOLE_HPP
+
+#include "virtio_mmio.hpp"
+#include "event_queue.hpp"
+#include "spsc_ring.hpp"
+#include <functional>
+#include <thread>
+#include <cstdio>
+
+#define VIRTIO_ID_CONSOLE       3
+
+#define VIRTIO_CONSOLE_RX       0
+#define VIRTIO_CONSOLE_TX       1
+
+// virtio console with a single port (hvc0 on Linux). Each queue notification moves whole
+// buffers, so the guest writes kilobytes of output with one MMIO access and one interrupt.
+// It offers the same host interface as the uarts and is drained by console_output.
+class virtio_console : public virtio_mmio {
+public:
+    virtio_console(mmio_dev &dma, event_queue &events):virtio_mmio(VIRTIO_ID_CONSOLE, dma, 2),events(events) {
+        rx_event = events.add_timer([this]() { fill_rx(); });
+    }
+    // Host input, called by the console input thread.
+    void putc(const char *buf, size_t len) {
+        size_t pos = 0;
+        while (true) {
+            pos += rx.push(buf + pos, len - pos);
+            events.post(rx_event); // the emulation thread copies it into guest buffers
+            if (pos == len) break;
+            std::this_thread::yield();
+        }
+    }
+    void putc(char c) {
+        putc(&c, 1);
+    }
+    // Guest output, consumed by the console output thread.
+    char getc() {
+        char res;
+        if (tx.pop(res)) return res;
+        else return EOF;
+    }
+    bool exist_tx() {
+        return !tx.empty();
+    }
+    void set_tx_notify(std::function<void()> notify) {
+        tx_notify = notify;
+    }
+protected:
+    uint64_t device_features() {
+        return 0;
+    }
+    bool config_read(uint64_t offset, uint64_t size, char* buffer) {
+        // struct virtio_console_config, its fields are only valid with features we do not offer
+        if (offset + size > 12) return false;
+        memset(buffer, 0, size);
+        return true;
+    }
+    void queue_notify(unsigned int queue) {
+        if (queue == VIRTIO_CONSOLE_RX) {
+            fill_rx();
+            return;
+        }
+        uint16_t head;
+        while (queue_pop(queue, head, chain)) {
+            // the chain length is up to the guest, copy it a piece at a time
+            char piece[4096];
+            uint64_t offset = 0, len;
+            while ((len = chain_read(chain, offset, piece, sizeof(piece)))) {
+                offset += len;
+                uint64_t pos = 0;
+                while (true) {
+                    pos += tx.push(piece + pos, len - pos);
+                    if (tx_notify) tx_notify();
+                    if (pos == len) break;
+                    std::this_thread::yield(); // wait for the output thread
+                }
+            }
+            queue_push(queue, head, 0);
+        }
+    }
+private:
+    // Move pending input into the buffers the driver posted on the receive queue.
+    void fill_rx() {
+        uint16_t head;
+        while (!rx.empty() && queue_ready(VIRTIO_CONSOLE_RX) && queue_pop(VIRTIO_CONSOLE_RX, head, chain)) {
+            uint64_t len = std::min(chain_size(chain, true), (uint64_t)rx_size);
+            if (buf.size() < len) buf.resize(len);
+            len = rx.pop(buf.data(), len);
+            queue_push(VIRTIO_CONSOLE_RX, head, chain_write(chain, 0, buf.data(), len));
+        }
+    }
+    static const size_t rx_size = 4096;
+    static const size_t tx_size = 64 * 1024;
+    event_queue &events;
+    int rx_event;
+    spsc_ring<char, rx_size> rx;
+    spsc_ring<char, tx_size> tx;
+    std::function<void()> tx_notify;
+    std::vector<virtq_buffer> chain;
+    std::vector<char> buf;
+};
+
+#endif
@@ -0,0 +1,306 @@
+#ifndef VIRTIO_MMIO_HPP
+#define VIRTIO_MMIO_HPP
+
+#include "mmio_dev.hpp"
+#include "irq_line.hpp"
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+#define VIRTIO_MMIO_MAGIC_VALUE         0x000
+#define VIRTIO_MMIO_VERSION             0x004
+#define VIRTIO_MMIO_DEVICE_ID           0x008
+#define VIRTIO_MMIO_VENDOR_ID           0x00c
+#define VIRTIO_MMIO_DEVICE_FEATURES     0x010
+#define VIRTIO_MMIO_DEVICE_FEATURES_SEL 0x014
+#define VIRTIO_MMIO_DRIVER_FEATURES     0x020
+#define VIRTIO_MMIO_DRIVER_FEATURES_SEL 0x024
+#define VIRTIO_MMIO_QUEUE_SEL           0x030
+#define VIRTIO_MMIO_QUEUE_NUM_MAX       0x034
+#define VIRTIO_MMIO_QUEUE_NUM           0x038
+#define VIRTIO_MMIO_QUEUE_READY         0x044
+#define VIRTIO_MMIO_QUEUE_NOTIFY        0x050
+#define VIRTIO_MMIO_INTERRUPT_STATUS    0x060
+#define VIRTIO_MMIO_INTERRUPT_ACK       0x064
+#define VIRTIO_MMIO_STATUS              0x070
+#define VIRTIO_MMIO_QUEUE_DESC_LOW      0x080
+#define VIRTIO_MMIO_QUEUE_DESC_HIGH     0x084
+#define VIRTIO_MMIO_QUEUE_DRIVER_LOW    0x090
+#define VIRTIO_MMIO_QUEUE_DRIVER_HIGH   0x094
+#define VIRTIO_MMIO_QUEUE_DEVICE_LOW    0x0a0
+#define VIRTIO_MMIO_QUEUE_DEVICE_HIGH   0x0a4
+#define VIRTIO_MMIO_CONFIG_GENERATION   0x0fc
+#define VIRTIO_MMIO_CONFIG              0x100
+
+#define VIRTIO_INT_USED_RING            1
+#define VIRTIO_INT_CONFIG_CHANGE        2
+
+#define VIRTIO_F_VERSION_1              (1ull << 32)
+
+#define VIRTQ_DESC_F_NEXT               1
+#define VIRTQ_DESC_F_WRITE              2
+#define VIRTQ_AVAIL_F_NO_INTERRUPT      1
+
+struct virtq_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+// One descriptor of a chain, already resolved from guest memory.
+struct virtq_buffer {
+    uint64_t addr;
+    uint32_t len;
+    bool write; // device writable
+};
+
+// Transport for virtio-mmio version 2 devices. Virtqueues are accessed in guest memory
+// through the dma bus. Subclasses provide the features, config space and queue handlers.
+class virtio_mmio : public mmio_dev {
+public:
+    virtio_mmio(uint32_t device_id, mmio_dev &dma, unsigned int nr_queue, uint16_t queue_num_max = 256)
+        :dma(dma),device_id(device_id),queues(nr_queue),queue_num_max(queue_num_max) {
+        reset();
+    }
+    bool do_read(uint64_t start_addr, uint64_t size, char* buffer) {
+        if (start_addr >= VIRTIO_MMIO_CONFIG) return config_read(start_addr - VIRTIO_MMIO_CONFIG, size, buffer);
+        if (size != 4 || start_addr % 4) return false;
+        uint32_t value = 0;
+        switch (start_addr) {
+            case VIRTIO_MMIO_MAGIC_VALUE:
+                value = 0x74726976; // "virt"
+                break;
+            case VIRTIO_MMIO_VERSION:
+                value = 2;
+                break;
+            case VIRTIO_MMIO_DEVICE_ID:
+                value = device_id;
+                break;
+            case VIRTIO_MMIO_VENDOR_ID:
+                value = 0x554d4551; // "QEMU", what guests expect from a generic host
+                break;
+            case VIRTIO_MMIO_DEVICE_FEATURES: {
+                uint64_t features = device_features() | VIRTIO_F_VERSION_1;
+                value = device_features_sel == 0 ? features : device_features_sel == 1 ? features >> 32 : 0;
+                break;
+            }
+            case VIRTIO_MMIO_QUEUE_NUM_MAX:
+                value = queue_sel < queues.size() ? queue_num_max : 0;
+                break;
+            case VIRTIO_MMIO_QUEUE_READY:
+                value = queue_sel < queues.size() ? queues[queue_sel].ready : 0;
+                break;
+            case VIRTIO_MMIO_INTERRUPT_STATUS:
+                value = interrupt_status;
+                break;
+            case VIRTIO_MMIO_STATUS:
+                value = status;
+                break;
+            case VIRTIO_MMIO_CONFIG_GENERATION:
+                value = config_generation;
+                break;
+            default:
+                break;
+        }
+        memcpy(buffer, &value, 4);
+        return true;
+    }
+    bool do_write(uint64_t start_addr, uint64_t size, const char* buffer) {
+        if (start_addr >= VIRTIO_MMIO_CONFIG) return config_write(start_addr - VIRTIO_MMIO_CONFIG, size, buffer);
+        if (size != 4 || start_addr % 4) return false;
+        uint32_t value;
+        memcpy(&value, buffer, 4);
+        virtq *q = queue_sel < queues.size() ? &queues[queue_sel] : nullptr;
+        switch (start_addr) {
+            case VIRTIO_MMIO_DEVICE_FEATURES_SEL:
+                device_features_sel = value;
+                break;
+            case VIRTIO_MMIO_DRIVER_FEATURES:
+                if (driver_features_sel == 0) driver_features = (driver_features & ~0xffffffffull) | value;
+                else if (driver_features_sel == 1) driver_features = (driver_features & 0xffffffffull) | ((uint64_t)value << 32);
+                break;
+            case VIRTIO_MMIO_DRIVER_FEATURES_SEL:
+                driver_features_sel = value;
+                break;
+            case VIRTIO_MMIO_QUEUE_SEL:
+                queue_sel = value;
+                break;
+            case VIRTIO_MMIO_QUEUE_NUM:
+                if (q && value && value <= queue_num_max && (value & (value - 1)) == 0) q->num = value;
+                break;
+            case VIRTIO_MMIO_QUEUE_READY:
+                if (q) {
+                    q->ready = (value & 1) && q->num; // a queue without a size cannot be used
+                    if (q->ready) q->last_avail = 0;
+                }
+                break;
+            case VIRTIO_MMIO_QUEUE_NOTIFY:
+                if (value < queues.size() && queues[value].ready && (status & 4)) queue_notify(value);
+                break;
+            case VIRTIO_MMIO_INTERRUPT_ACK:
+                interrupt_status &= ~value;
+                irq_out.set(interrupt_status != 0);
+                break;
+            case VIRTIO_MMIO_STATUS:
+                if (value == 0) reset();
+                else status = value;
+                break;
+            case VIRTIO_MMIO_QUEUE_DESC_LOW:    if (q) set_low(q->desc, value);         break;
+            case VIRTIO_MMIO_QUEUE_DESC_HIGH:   if (q) set_high(q->desc, value);        break;
+            case VIRTIO_MMIO_QUEUE_DRIVER_LOW:  if (q) set_low(q->avail, value);        break;
+            case VIRTIO_MMIO_QUEUE_DRIVER_HIGH: if (q) set_high(q->avail, value);       break;
+            case VIRTIO_MMIO_QUEUE_DEVICE_LOW:  if (q) set_low(q->used, value);         break;
+            case VIRTIO_MMIO_QUEUE_DEVICE_HIGH: if (q) set_high(q->used, value);        break;
+            default:
+                break;
+        }
+        return true;
+    }
+    void connect_irq(irq_sink *sink, unsigned int id) {
+        irq_out.connect(sink, id);
+    }
+protected:
+    virtual uint64_t device_features() = 0;
+    virtual bool config_read(uint64_t offset, uint64_t size, char* buffer) {
+        return false;
+    }
+    virtual bool config_write(uint64_t offset, uint64_t size, const char* buffer) {
+        return false;
+    }
+    // The driver made new buffers available on queue.
+    virtual void queue_notify(unsigned int queue) = 0;
+    virtual void device_reset() {}
+    bool driver_ok() {
+        return status & 4;
+    }
+    bool queue_ready(unsigned int queue) {
+        return driver_ok() && queues[queue].ready;
+    }
+    // Take the next available descriptor chain of queue, returns false if the driver has none.
+    // Malformed chains are returned to the driver unused, so the ones behind them still get through.
+    bool queue_pop(unsigned int queue, uint16_t &head, std::vector<virtq_buffer> &chain) {
+        virtq &q = queues[queue];
+        if (!q.ready || !q.num) return false;
+        while (true) {
+            uint16_t avail_idx;
+            if (!dma_read(q.avail + 2, 2, &avail_idx) || avail_idx == q.last_avail) return false;
+            if (!dma_read(q.avail + 4 + 2 * (q.last_avail % q.num), 2, &head)) return false;
+            q.last_avail ++;
+            if (read_chain(q, head, chain)) return true;
+            queue_push(queue, head, 0);
+        }
+    }
+    // Return a chain to the driver with written bytes stored into it, and interrupt unless suppressed.
+    void queue_push(unsigned int queue, uint16_t head, uint32_t written) {
+        virtq &q = queues[queue];
+        if (!q.ready || !q.num) return;
+        uint16_t used_idx;
+        dma_read(q.used + 2, 2, &used_idx);
+        uint32_t elem[2] = {head, written};
+        dma_write(q.used + 4 + 8 * (used_idx % q.num), 8, elem);
+        used_idx ++;
+        dma_write(q.used + 2, 2, &used_idx);
+        uint16_t avail_flags = 0;
+        dma_read(q.avail, 2, &avail_flags);
+        if (!(avail_flags & VIRTQ_AVAIL_F_NO_INTERRUPT)) raise_interrupt(VIRTIO_INT_USED_RING);
+    }
+    void config_changed() {
+        config_generation ++;
+        raise_interrupt(VIRTIO_INT_CONFIG_CHANGE);
+    }
+    // Gather len bytes at offset of the device readable part of a chain, returns bytes copied.
+    uint64_t chain_read(const std::vector<virtq_buffer> &chain, uint64_t offset, void *dst, uint64_t len) {
+        return chain_copy(chain, false, offset, (char*)dst, len);
+    }
+    // Scatter len bytes to offset of the device writable part of a chain, returns bytes copied.
+    uint64_t chain_write(const std::vector<virtq_buffer> &chain, uint64_t offset, const void *src, uint64_t len) {
+        return chain_copy(chain, true, offset, (char*)src, len);
+    }
+    static uint64_t chain_size(const std::vector<virtq_buffer> &chain, bool write) {
+        uint64_t res = 0;
+        for (auto &buf : chain) if (buf.write == write) res += buf.len;
+        return res;
+    }
+    bool dma_read(uint64_t addr, uint64_t size, void *dst) {
+        return dma.do_read(addr, size, (char*)dst);
+    }
+    bool dma_write(uint64_t addr, uint64_t size, const void *src) {
+        return dma.do_write(addr, size, (const char*)src);
+    }
+    mmio_dev &dma;
+    uint64_t driver_features;
+private:
+    struct virtq {
+        uint16_t num = 0;
+        bool ready = false;
+        uint16_t last_avail = 0;
+        uint64_t desc = 0;
+        uint64_t avail = 0;
+        uint64_t used = 0;
+    };
+    void reset() {
+        device_features_sel = 0;
+        driver_features = 0;
+        driver_features_sel = 0;
+        queue_sel = 0;
+        interrupt_status = 0;
+        status = 0;
+        config_generation = 0;
+        for (auto &q : queues) q = virtq();
+        irq_out.set(false);
+        device_reset();
+    }
+    bool read_chain(virtq &q, uint16_t head, std::vector<virtq_buffer> &chain) {
+        chain.clear();
+        uint16_t idx = head;
+        for (unsigned int i=0;i<q.num;i++) { // a chain never visits more than num descriptors
+            virtq_desc desc;
+            if (idx >= q.num || !dma_read(q.desc + 16 * idx, 16, &desc)) return false;
+            chain.push_back({desc.addr, desc.len, (desc.flags & VIRTQ_DESC_F_WRITE) != 0});
+            if (!(desc.flags & VIRTQ_DESC_F_NEXT)) return true;
+            idx = desc.next;
+        }
+        return false;
+    }
+    void raise_interrupt(uint32_t reason) {
+        interrupt_status |= reason;
+        irq_out.set(true);
+    }
+    uint64_t chain_copy(const std::vector<virtq_buffer> &chain, bool write, uint64_t offset, char *data, uint64_t len) {
+        uint64_t done = 0;
+        for (auto &buf : chain) {
+            if (buf.write != write) continue;
+            if (offset >= buf.len) {
+                offset -= buf.len;
+                continue;
+            }
+            uint64_t n = std::min((uint64_t)buf.len - offset, len - done);
+            bool ok = write ? dma_write(buf.addr + offset, n, data + done) : dma_read(buf.addr + offset, n, data + done);
+            if (!ok) break;
+            done += n;
+            offset = 0;
+            if (done == len) break;
+        }
+        return done;
+    }
+    static void set_low(uint64_t &reg, uint32_t value) {
+        reg = (reg & ~0xffffffffull) | value;
+    }
+    static void set_high(uint64_t &reg, uint32_t value) {
+        reg = (reg & 0xffffffffull) | ((uint64_t)value << 32);
+    }
+    uint32_t device_id;
+    std::vector<virtq> queues;
+    uint16_t queue_num_max;
+    uint32_t device_features_sel;
+    uint32_t driver_features_sel;
+    uint32_t queue_sel;
+    uint32_t interrupt_status;
+    uint32_t status;
+    uint32_t config_generation;
+    irq_line irq_out;
+};
+
+#endif
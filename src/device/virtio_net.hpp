@@ -0,0 +1,111 @@
+#ifndef VIRTIO_NET_HPP
+#define VIRTIO_NET_HPP
+
+#include "virtio_mmio.hpp"
+#include "event_queue.hpp"
+#include "spsc_ring.hpp"
+#include "net_backend.hpp"
+#include <thread>
+
+#define VIRTIO_ID_NET           1
+
+#define VIRTIO_NET_F_MAC        (1ull << 5)
+#define VIRTIO_NET_F_STATUS     (1ull << 16)
+
+#define VIRTIO_NET_S_LINK_UP    1
+
+#define VIRTIO_NET_RX           0
+#define VIRTIO_NET_TX           1
+
+// virtio network device, frames go to and come from a net_backend. Both queues take
+// multi-descriptor chains and any number of frames per notification.
+class virtio_net : public virtio_mmio {
+public:
+    virtio_net(mmio_dev &dma, event_queue &events, net_backend &backend, const uint8_t mac[6])
+        :virtio_mmio(VIRTIO_ID_NET, dma, 2),events(events),backend(backend) {
+        memcpy(config.mac, mac, 6);
+        config.status = VIRTIO_NET_S_LINK_UP;
+        rx_event = events.add_timer([this]() { fill_rx(); });
+        backend.start([this](const char *frame, size_t len) { receive(frame, len); });
+    }
+protected:
+    uint64_t device_features() {
+        return VIRTIO_NET_F_MAC | VIRTIO_NET_F_STATUS;
+    }
+    bool config_read(uint64_t offset, uint64_t size, char* buffer) {
+        if (offset + size > sizeof(config)) return false;
+        memcpy(buffer, (char*)&config + offset, size);
+        return true;
+    }
+    bool config_write(uint64_t offset, uint64_t size, const char* buffer) {
+        // the MAC is writable by legacy drivers, keep it consistent for those
+        if (offset + size > 6) return false;
+        memcpy(config.mac + offset, buffer, size);
+        return true;
+    }
+    void queue_notify(unsigned int queue) {
+        if (queue == VIRTIO_NET_RX) {
+            fill_rx();
+            return;
+        }
+        uint16_t head;
+        while (queue_pop(queue, head, chain)) {
+            uint64_t len = chain_size(chain, false);
+            if (len > sizeof(virtio_net_hdr) && len <= sizeof(tx_frame)) {
+                len = chain_read(chain, sizeof(virtio_net_hdr), tx_frame, len - sizeof(virtio_net_hdr));
+                backend.send(tx_frame, len);
+            }
+            queue_push(queue, head, 0);
+        }
+    }
+private:
+    struct virtio_net_hdr {
+        uint8_t flags;
+        uint8_t gso_type;
+        uint16_t hdr_len;
+        uint16_t gso_size;
+        uint16_t csum_start;
+        uint16_t csum_offset;
+        uint16_t num_buffers;
+    };
+    struct frame {
+        uint32_t len;
+        char data[2048];
+    };
+    // Backend thread, frames wait in the ring until the guest posts receive buffers.
+    void receive(const char *data, size_t len) {
+        if (len > sizeof(frame::data)) return; // larger than any MTU we advertise
+        rx_frame.len = len;
+        memcpy(rx_frame.data, data, len);
+        while (!rx.push(rx_frame)) std::this_thread::yield();
+        events.post(rx_event);
+    }
+    void fill_rx() {
+        uint16_t head;
+        while (!rx.empty() && queue_ready(VIRTIO_NET_RX) && queue_pop(VIRTIO_NET_RX, head, chain)) {
+            rx.pop(fill_frame);
+            virtio_net_hdr hdr = {};
+            hdr.num_buffers = 1;
+            uint32_t written = 0;
+            if (chain_size(chain, true) >= sizeof(hdr) + fill_frame.len) {
+                written = chain_write(chain, 0, &hdr, sizeof(hdr));
+                written += chain_write(chain, sizeof(hdr), fill_frame.data, fill_frame.len);
+            }
+            queue_push(VIRTIO_NET_RX, head, written);
+        }
+    }
+    struct {
+        uint8_t mac[6];
+        uint16_t status;
+    } config;
+    event_queue &events;
+    net_backend &backend;
+    int rx_event;
+    spsc_ring<frame, 256> rx;
+    frame rx_frame;     // owned by the backend thread
+    frame fill_frame;   // owned by the emulation thread
+    char tx_frame[65536];
+    std::vector<virtq_buffer> chain;
+};
+
+#endif
@@ -2,15 +2,16 @@
 #define XILINX_EMACLITE
 
 #include "mmio_dev.hpp"
+#include "irq_line.hpp"
+#include "spsc_ring.hpp"
 #include <cstring>
 #include <cassert>
-#include <queue>
-#include <utility>
-#include <mutex>
+#include <atomic>
+#include <algorithm>
 
-// No MDIO, No ping-pong buffer(Set both number of transmit and receive buffer to 0).
-
-// TODO: ping pong buffer support
+// AXI EthernetLite with ping-pong TX and RX buffers (C_TX_PING_PONG = C_RX_PING_PONG = 1), no MDIO.
+// Frames move between the buffers and lock-free queues to the link partner. The guest only sees
+// buffer state through MMIO, so queued frames are moved into free buffers when it looks.
 
 enum axiemac_regmap {
     XEL_TXBUFF_OFFST    = 0x0,	    /* Transmit Buffer */
@@ -18,15 +19,15 @@ enum axiemac_regmap {
     XEL_GIER_OFFSET     = 0x07F8,   /* GIE Register */
     XEL_TSR_OFFSET      = 0x07FC,   /* Tx status */
     XEL_RXBUFF_OFFSET   = 0x1000,   /* Receive Buffer */
-    XEL_RPLR_OFFSET     = 0x100C,   /* Rx packet length */
-    XEL_RSR_OFFSET      = 0x17FC    /* Rx status */
+    XEL_RSR_OFFSET      = 0x17FC,   /* Rx status */
+    XEL_BUFFER_OFFSET   = 0x0800    /* Next buffer's offset, pong = ping + XEL_BUFFER_OFFSET */
 };
 
 struct xel_tx_ctrl_reg {
     unsigned int status : 1;
     unsigned int program : 1; // program new mac addr
     unsigned int r0 : 1;
-    unsigned int int_en : 1; // interrupt enable
+    unsigned int int_en : 1; // interrupt enable, ping only
     // no loopback support
     unsigned int r1 : 28;
 };
@@ -34,7 +35,7 @@ struct xel_tx_ctrl_reg {
 struct xel_rx_ctrl_reg {
     unsigned int status : 1;
     unsigned int r0 : 2;
-    unsigned int int_en : 1;
+    unsigned int int_en : 1; // ping only
     unsigned int r1 : 28;
 };
 
@@ -43,6 +44,7 @@ struct xel_gie_reg {
     unsigned int gie : 1;
 };
 
+// tx_buffer_size and rx_buffer_size are the frames queued towards and from the link partner.
 template <size_t tx_buffer_size = 16, size_t rx_buffer_size = 16>
 class xilinx_emaclite : public mmio_dev {
 public:
@@ -50,46 +52,47 @@ public:
         reset();
     }
     void reset() {
-        tx_buffer_head = tx_buffer_tail = rx_buffer_head = rx_buffer_tail = 0;
-        memset(tx_buffer_len, 0, sizeof(tx_buffer_len));
-        memset(rx_buffer_len, 0, sizeof(rx_buffer_len));
         mac_addr[0] = 0x00; mac_addr[1] = 0x00; mac_addr[2] = 0x5E;
         mac_addr[3] = 0x00; mac_addr[4] = 0xFA; mac_addr[5] = 0xCE;
         need_irq = false;
-        memset(&tx_ping_ctrl, 0, sizeof(tx_ping_ctrl));
-        memset(&rx_ping_ctrl, 0, sizeof(tx_ping_ctrl));
-        memset(&gie, 0, sizeof(tx_ping_ctrl));
-        memset(tx_ping_buffer, 0, sizeof(tx_ping_buffer));
-        tx_ping_buffer_len = 0;
+        tx_irq_en = false;
+        rx_irq_en = false;
+        tx_stalled = false;
+        memset(tx_ctrl, 0, sizeof(tx_ctrl));
+        memset(rx_ctrl, 0, sizeof(rx_ctrl));
+        memset(&gie, 0, sizeof(gie));
+        memset(tx_buf, 0, sizeof(tx_buf));
+        memset(tx_len, 0, sizeof(tx_len));
+        memset(rx_buf, 0, sizeof(rx_buf));
+        tx_pending_nr = 0;
+        rx_next_fill = 0;
     }
     bool do_read(uint64_t start_addr, uint64_t size, char* buffer) {
-        if (XEL_TXBUFF_OFFST <= start_addr && start_addr+size <= XEL_TXBUFF_OFFST + 2036) { // tx buffer
-            memcpy(buffer, tx_ping_buffer+start_addr-XEL_TXBUFF_OFFST, size);
+        if (start_addr + size > 2 * 2 * XEL_BUFFER_OFFSET) {
+            memset(buffer, 0x0, size);
+            return true;
         }
-        else if (XEL_RXBUFF_OFFSET <= start_addr && start_addr+size <= XEL_RXBUFF_OFFSET + 2036) { // rx buffer
-            memcpy(buffer, rx_buffer[rx_buffer_head]+start_addr-XEL_RXBUFF_OFFSET, size);
+        bool rx = start_addr >= XEL_RXBUFF_OFFSET;
+        int idx = (start_addr / XEL_BUFFER_OFFSET) % 2;
+        uint64_t offset = start_addr % XEL_BUFFER_OFFSET;
+        if (rx) refill_rx();
+        else retry_tx();
+        if (offset + size <= 2036) { // frame buffer
+            memcpy(buffer, (rx ? rx_buf[idx] : tx_buf[idx]) + offset, size);
         }
-        else if (size == 4 && (start_addr&0x3) == 0) { // reg
-            // printf("emaclite read %lx size %d \n", start_addr, size);
-            switch (start_addr) {
-                case XEL_TPLR_OFFSET: {
-                    std::unique_lock<std::mutex> lock(tx_lock);
-                    memcpy(buffer, &tx_ping_buffer_len, size);
+        else if (size == 4 && (offset&0x3) == 0) { // reg
+            switch (offset) {
+                case XEL_TPLR_OFFSET:
+                    if (!rx) memcpy(buffer, &tx_len[idx], size);
+                    else memset(buffer, 0x0, size);
                     break;
-                }
                 case XEL_GIER_OFFSET:
-                    memcpy(buffer, &gie, size);
+                    if (!rx && idx == 0) memcpy(buffer, &gie, size);
+                    else memset(buffer, 0x0, size);
                     break;
-                case XEL_TSR_OFFSET:
-                    memcpy(buffer, &tx_ping_ctrl, size);
-                    break;
-                case XEL_RPLR_OFFSET: {
-                    std::unique_lock<std::mutex> lock(rx_lock);
-                    memcpy(buffer, &rx_buffer_len[rx_buffer_head], size);
-                    break;
-                }
-                case XEL_RSR_OFFSET:
-                    memcpy(buffer, &rx_ping_ctrl, size);
+                case XEL_TSR_OFFSET: // also RSR
+                    if (rx) memcpy(buffer, &rx_ctrl[idx], size);
+                    else memcpy(buffer, &tx_ctrl[idx], size);
                     break;
                 default:
                     memset(buffer, 0x0, size);
@@ -100,66 +103,32 @@ public:
         return true;
     }
     bool do_write(uint64_t start_addr, uint64_t size, const char* buffer) {
-        if (XEL_TXBUFF_OFFST <= start_addr && start_addr+size <= XEL_TXBUFF_OFFST+2036) { // tx buffer
-            memcpy(tx_ping_buffer+start_addr-XEL_TXBUFF_OFFST, buffer, size);
+        if (start_addr + size > 2 * 2 * XEL_BUFFER_OFFSET) return true;
+        bool rx = start_addr >= XEL_RXBUFF_OFFSET;
+        int idx = (start_addr / XEL_BUFFER_OFFSET) % 2;
+        uint64_t offset = start_addr % XEL_BUFFER_OFFSET;
+        if (offset + size <= 2036) { // frame buffer, the rx side is read only
+            if (!rx) memcpy(tx_buf[idx] + offset, buffer, size);
         }
-        else if (size == 4 && (start_addr&0x3) == 0) { // reg
-            // printf("emaclite write %lx size %d \n", start_addr, size);
-            switch (start_addr) {
+        else if (size == 4 && (offset&0x3) == 0) { // reg
+            switch (offset) {
                 case XEL_GIER_OFFSET: {
+                    if (rx || idx) break;
                     xel_gie_reg *to_write = (xel_gie_reg *)buffer;
                     gie.gie = to_write->gie;
-                    // printf("gie set to %d\n", gie.gie);
+                    update_irq_en();
                     break;
                 }
                 case XEL_TPLR_OFFSET: {
-                    std::unique_lock<std::mutex> lock(tx_lock);
-                    uint16_t *to_write = (uint16_t *)buffer;
-                    tx_ping_buffer_len = *to_write <= 2048 ? *to_write : 0;
+                    if (rx) break;
+                    uint32_t len = *(uint32_t *)buffer;
+                    tx_len[idx] = len <= 2036 ? len : 0;
                     break;
                 }
-                case XEL_TSR_OFFSET: {
-                    std::unique_lock<std::mutex> lock(tx_lock);
-                    xel_tx_ctrl_reg *to_write = (xel_tx_ctrl_reg *)buffer;
-                    tx_ping_ctrl.int_en = to_write->int_en;
-                    // printf("tx ping int en = %d\n", tx_ping_ctrl.int_en);
-                    if (to_write->status) {
-                        // add to transmit buffer
-                        if (to_write->program) { // program mac addr
-                            memcpy(mac_addr, tx_ping_buffer, 6);
-                        }
-                        else { // transmit eth frame
-                            if (tx_buffer_tail + 1 != tx_buffer_head) {
-                                memcpy(tx_buffer[tx_buffer_tail], tx_ping_buffer, tx_buffer_len[tx_buffer_tail]);
-                                tx_buffer_len[tx_buffer_tail] = tx_ping_buffer_len;
-                                tx_buffer_tail ++;
-                                if (tx_buffer_tail + 1 == tx_buffer_head) {
-                                    tx_ping_ctrl.status = 1; // buffer full, waiting to pop
-                                }
-                                else {
-                                    need_irq |= tx_ping_ctrl.int_en && gie.gie; // immediate irq
-                                }
-                            }
-                        }
-                    }
-                    break;
-                }
-                case XEL_RSR_OFFSET: {
-                    std::unique_lock<std::mutex> lock(rx_lock);
-                    xel_rx_ctrl_reg *to_write = (xel_rx_ctrl_reg *)buffer;
-                    rx_ping_ctrl.int_en = to_write->int_en;
-                    // printf("rx ping int en = %d\n", rx_ping_ctrl.int_en);
-                    if (!to_write->status) {
-                        if (rx_buffer_head != rx_buffer_tail) {
-                            rx_buffer_head ++;
-                            need_irq |= rx_ping_ctrl.int_en && gie.gie; // immediate irq
-                        }
-                        else {
-                            rx_ping_ctrl.status = 0;
-                        }
-                    }
+                case XEL_TSR_OFFSET:
+                    if (rx) write_rsr(idx, *(xel_rx_ctrl_reg *)buffer);
+                    else write_tsr(idx, *(xel_tx_ctrl_reg *)buffer);
                     break;
-                }
                 default:
                     break;
             }
@@ -168,56 +137,117 @@ public:
     }
     bool tx_frame(size_t size, char *src) { // link partner side tx, cemu side rx
         assert(size <= 2048);
-        std::unique_lock<std::mutex> lock(rx_lock);
-        if ((rx_buffer_tail+1)%rx_buffer_size == rx_buffer_head) return false;
-        if (size >= 14) { // illegal frame
-            // check mac addr, must be the dst addr or broadcast
-            if (strncmp(src, mac_addr, 6) == 0 || strncmp(src, "\xff\xff\xff\xff\xff\xff", 6) == 0) {
-                memcpy(rx_buffer[rx_buffer_tail], src, size);
-                rx_buffer_len[rx_buffer_tail] = size;
-                rx_buffer_tail++;
-                need_irq |= rx_ping_ctrl.int_en && gie.gie;
-                rx_ping_ctrl.status = 1;
-            }
-            // else printf("warning packet filterd\n");
-            return true;
-            // return true even if filterd
-            
-        }
-        else return false;
+        if (size < 14) return false; // illegal frame
+        frame f;
+        f.len = size;
+        memcpy(f.data, src, size);
+        if (!rx_queue.push(f)) return false;
+        // the frame lands in a buffer when the guest looks at one, the destination is checked there
+        raise_irq(rx_irq_en);
+        return true;
     }
     size_t rx_frame(char *dst) { // link partner side rx, cemu side tx
         // dst should not smaller than 2048 bytes, return 0 if no packet available
-        std::unique_lock<std::mutex> lock(tx_lock);
-        if (tx_buffer_head == tx_buffer_tail) return 0; // no new frame
-        memcpy(dst, tx_buffer[tx_buffer_head], tx_buffer_len[tx_buffer_head]);
-        uint16_t res = tx_buffer_len[tx_buffer_head];
-        if (tx_buffer_head + 1 == tx_buffer_tail) {
-            // full -> available
-            tx_ping_ctrl.status = 0;
-            need_irq |= tx_ping_ctrl.int_en && gie.gie;
-        }
-        tx_buffer_head ++;
-        return res;
+        frame f;
+        if (!tx_queue.pop(f)) return 0;
+        memcpy(dst, f.data, f.len);
+        // a buffer waiting for queue space completes on the next TSR read
+        if (tx_stalled) raise_irq(tx_irq_en);
+        return f.len;
     }
     bool edge_irq() {
-        bool res = need_irq;
-        need_irq = false;
-        return res;
+        return need_irq.exchange(false);
+    }
+    void connect_irq(irq_sink *sink, unsigned int id) {
+        irq_out.connect(sink, id);
     }
 private:
+    struct frame {
+        uint16_t len;
+        char data[2048];
+    };
+    void write_tsr(int idx, xel_tx_ctrl_reg value) {
+        if (idx == 0) {
+            tx_ctrl[0].int_en = value.int_en;
+            update_irq_en();
+        }
+        if (!value.status || tx_ctrl[idx].status) return;
+        if (value.program) { // program mac addr
+            memcpy(mac_addr, tx_buf[idx], 6);
+            return;
+        }
+        tx_ctrl[idx].status = 1; // busy until the frame is queued to the link partner
+        tx_pending[tx_pending_nr++] = idx;
+        retry_tx();
+    }
+    void write_rsr(int idx, xel_rx_ctrl_reg value) {
+        if (idx == 0) {
+            rx_ctrl[0].int_en = value.int_en;
+            update_irq_en();
+        }
+        if (!value.status && rx_ctrl[idx].status) {
+            rx_ctrl[idx].status = 0; // the driver consumed this buffer
+            refill_rx();
+        }
+    }
+    // Queue busy TX buffers in the order the driver started them.
+    void retry_tx() {
+        bool done = false;
+        while (tx_pending_nr) {
+            int idx = tx_pending[0];
+            frame f;
+            f.len = tx_len[idx];
+            memcpy(f.data, tx_buf[idx], f.len);
+            if (!tx_queue.push(f)) break;
+            tx_ctrl[idx].status = 0;
+            tx_pending[0] = tx_pending[1];
+            tx_pending_nr --;
+            done = true;
+        }
+        tx_stalled = tx_pending_nr != 0;
+        if (done) raise_irq(tx_irq_en);
+    }
+    // Fill free RX buffers alternately, as the hardware does.
+    void refill_rx() {
+        frame f;
+        bool done = false;
+        while (!rx_ctrl[rx_next_fill].status && rx_queue.pop(f)) {
+            // must be our address or broadcast
+            if (memcmp(f.data, mac_addr, 6) != 0 && memcmp(f.data, "\xff\xff\xff\xff\xff\xff", 6) != 0) continue;
+            memcpy(rx_buf[rx_next_fill], f.data, std::min((size_t)f.len, sizeof(rx_buf[0])));
+            rx_ctrl[rx_next_fill].status = 1;
+            rx_next_fill ^= 1;
+            done = true;
+        }
+        if (done) raise_irq(rx_irq_en);
+    }
+    void update_irq_en() {
+        tx_irq_en = tx_ctrl[0].int_en && gie.gie;
+        rx_irq_en = rx_ctrl[0].int_en && gie.gie;
+    }
+    void raise_irq(bool cond) {
+        if (cond) {
+            need_irq = true;
+            irq_out.pulse();
+        }
+    }
+    irq_line irq_out;
+    // owned by the emulation thread
     char mac_addr[6];
     xel_gie_reg     gie;
-    xel_tx_ctrl_reg tx_ping_ctrl;
-    xel_rx_ctrl_reg rx_ping_ctrl;
-    uint16_t tx_buffer_len[tx_buffer_size], rx_buffer_len[rx_buffer_size];
-    char tx_buffer[tx_buffer_size][2048], rx_buffer[rx_buffer_size][2048];
-    char tx_ping_buffer[2048];
-    uint16_t tx_ping_buffer_len;
-    // rx zero copy
-    unsigned int tx_buffer_head, tx_buffer_tail, rx_buffer_head, rx_buffer_tail;
-    std::mutex tx_lock, rx_lock;
-    bool need_irq;
+    xel_tx_ctrl_reg tx_ctrl[2]; // ping, pong
+    xel_rx_ctrl_reg rx_ctrl[2];
+    char tx_buf[2][2036], rx_buf[2][2036];
+    uint32_t tx_len[2];
+    int tx_pending[2];
+    int tx_pending_nr;
+    int rx_next_fill;
+    // shared with the link partner threads
+    spsc_ring<frame, tx_buffer_size> tx_queue;
+    spsc_ring<frame, rx_buffer_size> rx_queue;
+    std::atomic<bool> tx_irq_en, rx_irq_en;
+    std::atomic<bool> tx_stalled;
+    std::atomic<bool> need_irq;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -2,41 +2,89 @@
 #include <bitset>
 
 #include "memory_bus.hpp"
+#include "static_map.hpp"
 #include "uartlite.hpp"
 #include "ram.hpp"
 #include "rv_core.hpp"
 #include "rv_systembus.hpp"
 #include "rv_clint.hpp"
 #include "rv_plic.hpp"
+#include "host_clock.hpp"
+#include "host_input.hpp"
+#include "event_queue.hpp"
+#include "console_output.hpp"
+#include "virtio_blk.hpp"
+#include "virtio_console.hpp"
+#include "virtio_net.hpp"
+#include "checkpoint.hpp"
+#include "fork_snapshots.hpp"
+#include "input_log.hpp"
 #include <termios.h>
 #include <unistd.h>
 #include <thread>
+#include <chrono>
 #include <signal.h>
+#include <cerrno>
+#include <fstream>
+#include <filesystem>
+#include <vector>
+#include <algorithm>
 
 bool riscv_test = false;
+bool realtime = false;
 
-rv_core *rv_0_ptr;
-rv_core *rv_1_ptr;
+// timebase-frequency in the device tree
+const uint64_t timebase_freq = 100000000;
 
-void uart_input(uartlite &uart) {
+// size of the DRAM window at 0x80000000, the largest RAM the machine can have
+const uint64_t dram_window = 2048l*1024l*1024l;
+
+// Fixed part of the machine, decoded at compile time with RAM first. Optional devices are added at runtime.
+typedef static_map<
+    static_range<0x80000000, dram_window, ram>,
+    static_range<0x2000000, 0x10000, rv_clint<2> >,
+    static_range<0xc000000, 0x4000000, rv_plic<4,4> >,
+    static_range<0x60100000, 1024*1024, uartlite>
+> machine_map;
+typedef basic_rv_systembus<machine_map> machine_bus;
+
+rv_core<machine_bus> *rv_0_ptr;
+rv_core<machine_bus> *rv_1_ptr;
+
+// stdin and Ctrl-C, read by the uart input thread only
+host_input keyboard;
+
+template <typename uart_t>
+void uart_input(uart_t &uart, host_clock &clock) {
     termios tmp;
     tcgetattr(STDIN_FILENO,&tmp);
     tmp.c_lflag &=(~ICANON & ~ECHO);
     tcsetattr(STDIN_FILENO,TCSANOW,&tmp);
+    char buf[256];
     while (1) {
-        char c = getchar();
-        if (c == 10) c = 13; // convert lf to cr
-        /*
-        if (c == 'p') {
-            printf("hart0 pc=%lx\n",rv_0_ptr->getPC());
-            printf("hart1 pc=%lx\n",rv_1_ptr->getPC());
-        }
-        */
-        uart.putc(c);
+        ssize_t n = keyboard.read(buf, sizeof(buf));
+        if (n <= 0) break;
+        for (ssize_t i=0;i<n;i++) if (buf[i] == 10) buf[i] = 13; // convert lf to cr
+        uart.putc(buf, n);
+        clock.notify();
     }
 }
 
+// Sizes like 512M or 2G, plain numbers are bytes. Returns 0 when malformed.
+uint64_t parse_size(const char *str) {
+    char *end;
+    uint64_t value = strtoull(str, &end, 0);
+    switch (*end) {
+        case 'G': case 'g': value <<= 30; end++; break;
+        case 'M': case 'm': value <<= 20; end++; break;
+        case 'K': case 'k': value <<= 10; end++; break;
+    }
+    return *end ? 0 : value;
+}
+
 bool send_ctrl_c;
+volatile sig_atomic_t save_requested;
+volatile sig_atomic_t rewind_requested;
 
 void sigint_handler(int x) {
     static time_t last_time;
@@ -45,59 +93,350 @@ void sigint_handler(int x) {
     send_ctrl_c = true;
 }
 
+void sigusr1_handler(int x) {
+    save_requested = true;
+}
+
+void sigusr2_handler(int x) {
+    rewind_requested = true;
+}
+
 int main(int argc, const char* argv[]) {
 
     signal(SIGINT, sigint_handler);
+    signal(SIGUSR1, sigusr1_handler);
 
     const char *load_path = "../opensbi/build/platform/generic/firmware/fw_payload.bin";
+    const char *blk_path = nullptr;
+    bool blk_cow = false;
+    bool use_virtio_console = false;
+    const char *net_local = nullptr, *net_peer = nullptr;
+    const char *pcap_in = nullptr, *pcap_out = nullptr;
+    uint64_t mem_size = dram_window;
+    const char *save_path = nullptr, *restore_path = nullptr;
+    uint64_t save_at = 0;
+    uint64_t snapshot_every = 0, snapshot_keep = 8;
+    const char *fuzz_dir = nullptr;
+    const char *record_path = nullptr, *replay_path = nullptr;
+    uint64_t fuzz_at = 0, fuzz_addr = 0, fuzz_crash = 0, fuzz_ticks = 10000000;
     if (argc >= 2) load_path = argv[1];
-    for (int i=1;i<argc;i++) if (strcmp(argv[i],"-rvtest") == 0) riscv_test = true;
+    for (int i=1;i<argc;i++) {
+        if (strcmp(argv[i],"-rvtest") == 0) riscv_test = true;
+        if (strcmp(argv[i],"-realtime") == 0) realtime = true;
+        if (strcmp(argv[i],"-virtio-console") == 0) use_virtio_console = true;
+        if (strcmp(argv[i],"-net-socket") == 0 && i + 2 < argc) {
+            // connect two instances with -net-socket a.sock b.sock and -net-socket b.sock a.sock
+            net_local = argv[++i];
+            net_peer = argv[++i];
+        }
+        if (strcmp(argv[i],"-mem") == 0 && i + 1 < argc) {
+            // should match the memory node in the device tree
+            mem_size = parse_size(argv[++i]);
+            if (mem_size == 0 || mem_size > dram_window) {
+                std::cerr << "invalid memory size " << argv[i] << ", at most 2G" << std::endl;
+                return 1;
+            }
+        }
+        // -save writes a checkpoint on SIGUSR1, or once at tick N with -save-at N
+        if (strcmp(argv[i],"-save") == 0 && i + 1 < argc) save_path = argv[++i];
+        if (strcmp(argv[i],"-save-at") == 0 && i + 1 < argc) save_at = strtoull(argv[++i],nullptr,0);
+        if (strcmp(argv[i],"-restore") == 0 && i + 1 < argc) restore_path = argv[++i];
+        // -snapshot-every N forks a snapshot every N ticks, SIGUSR2 rewinds to the newest one
+        if (strcmp(argv[i],"-snapshot-every") == 0 && i + 1 < argc) snapshot_every = strtoull(argv[++i],nullptr,0);
+        if (strcmp(argv[i],"-snapshot-keep") == 0 && i + 1 < argc) snapshot_keep = strtoull(argv[++i],nullptr,0);
+        // -record logs host input with its guest time, -replay feeds a log back instead of host input
+        if (strcmp(argv[i],"-record") == 0 && i + 1 < argc) record_path = argv[++i];
+        if (strcmp(argv[i],"-replay") == 0 && i + 1 < argc) replay_path = argv[++i];
+        // -fuzz-dir runs each file as a test case from the state reached when hart 0 first gets to -fuzz-at
+        if (strcmp(argv[i],"-fuzz-dir") == 0 && i + 1 < argc) fuzz_dir = argv[++i];
+        if (strcmp(argv[i],"-fuzz-at") == 0 && i + 1 < argc) fuzz_at = strtoull(argv[++i],nullptr,0);
+        if (strcmp(argv[i],"-fuzz-addr") == 0 && i + 1 < argc) fuzz_addr = strtoull(argv[++i],nullptr,0);
+        if (strcmp(argv[i],"-fuzz-crash") == 0 && i + 1 < argc) fuzz_crash = strtoull(argv[++i],nullptr,0);
+        if (strcmp(argv[i],"-fuzz-ticks") == 0 && i + 1 < argc) fuzz_ticks = strtoull(argv[++i],nullptr,0);
+        if (strcmp(argv[i],"-net-pcap-in") == 0 && i + 1 < argc) pcap_in = argv[++i];
+        if (strcmp(argv[i],"-net-pcap-out") == 0 && i + 1 < argc) pcap_out = argv[++i];
+        if ((strcmp(argv[i],"-blk") == 0 || strcmp(argv[i],"-blk-cow") == 0) && i + 1 < argc) {
+            // -blk-cow keeps guest writes in memory and leaves the image untouched
+            blk_cow = strcmp(argv[i],"-blk-cow") == 0;
+            blk_path = argv[++i];
+        }
+    }
+
+    // a rewound snapshot would restart plain host input and leave the abandoned timeline in the log
+    if (snapshot_every && (fuzz_dir || record_path || replay_path)) {
+        std::cerr << "snapshots cannot be combined with fuzzing, record or replay" << std::endl;
+        return 1;
+    }
 
-    rv_systembus system_bus;
+    std::vector<std::filesystem::path> fuzz_cases;
+    if (fuzz_dir) {
+        if (!fuzz_at || realtime || blk_path || use_virtio_console || net_local || pcap_in || pcap_out) {
+            std::cerr << "fuzzing needs -fuzz-at, and works without -realtime and virtio devices" << std::endl;
+            return 1;
+        }
+        std::error_code ec;
+        for (auto &entry : std::filesystem::directory_iterator(fuzz_dir, ec)) {
+            if (entry.is_regular_file()) fuzz_cases.push_back(entry.path());
+        }
+        std::sort(fuzz_cases.begin(), fuzz_cases.end());
+        if (ec || fuzz_cases.empty()) {
+            std::cerr << "no test cases in " << fuzz_dir << std::endl;
+            return 1;
+        }
+    }
 
+    input_log *input = nullptr;
+    if (record_path || replay_path) {
+        if (realtime || (blk_path && !blk_cow) || use_virtio_console || net_local || pcap_in || pcap_out) {
+            std::cerr << "record and replay need a deterministic run, without -realtime and with -blk-cow as the only virtio device" << std::endl;
+            return 1;
+        }
+        input = new input_log(record_path ? record_path : replay_path, record_path ? input_log::RECORD : input_log::REPLAY);
+        if (!input->is_open()) {
+            std::cerr << "failed to open input log " << (record_path ? record_path : replay_path) << std::endl;
+            return 1;
+        }
+    }
+
+    fork_snapshots *snapshots = nullptr;
+    if (snapshot_every) {
+        if ((blk_path && !blk_cow) || use_virtio_console || net_local || pcap_in || pcap_out) {
+            std::cerr << "snapshots need -blk-cow and no other virtio devices" << std::endl;
+            return 1;
+        }
+        snapshots = new fork_snapshots(snapshot_keep);
+        signal(SIGUSR2, sigusr2_handler);
+    }
+    uint64_t next_snapshot = 0;
+
+    event_queue events;
     uartlite uart;
-    rv_clint<2> clint;
+    rv_clint<2> clint(events);
     rv_plic <4,4> plic;
-    ram dram(4096l*1024l*1024l,load_path);
-    assert(system_bus.add_dev(0x2000000,0x10000,&clint));
-    assert(system_bus.add_dev(0xc000000,0x4000000,&plic));
-    assert(system_bus.add_dev(0x60100000,1024*1024,&uart));
-    assert(system_bus.add_dev(0x80000000,2048l*1024l*1024l,&dram));
+    ram dram(mem_size,load_path);
+    machine_bus system_bus(dram,clint,plic,uart);
+    uart.connect_irq(&plic,1);
+
+    virtio_blk *blk = nullptr;
+    if (blk_path) {
+        blk = new virtio_blk(system_bus,blk_path,blk_cow);
+        if (!blk->is_open()) {
+            std::cerr << "failed to open disk image " << blk_path << std::endl;
+            return 1;
+        }
+        assert(system_bus.add_dev(0x60200000,0x1000,blk));
+        blk->connect_irq(&plic,2);
+    }
+    virtio_console *vcon = nullptr;
+    if (use_virtio_console) {
+        vcon = new virtio_console(system_bus,events);
+        assert(system_bus.add_dev(0x60201000,0x1000,vcon));
+        vcon->connect_irq(&plic,3);
+    }
+    net_backend *backend = nullptr;
+    uint8_t mac[6] = {0x52,0x54,0x00,0x12,0x34,0x56};
+    if (net_local) {
+        backend = new unix_dgram_backend(net_local,net_peer);
+        mac[5] = std::hash<std::string>()(net_local); // distinct addresses on a shared link
+    }
+    else if (pcap_in || pcap_out) backend = new pcap_backend(pcap_in,pcap_out);
+    if (backend) {
+        virtio_net *net = new virtio_net(system_bus,events,*backend,mac);
+        assert(system_bus.add_dev(0x60202000,0x1000,net));
+        net->connect_irq(&plic,4);
+    }
 
-    rv_core rv_0(system_bus,0);
+    rv_core<machine_bus> rv_0(system_bus,0);
     rv_0_ptr = &rv_0;
-    rv_core rv_1(system_bus,1);
+    rv_core<machine_bus> rv_1(system_bus,1);
     rv_1_ptr = &rv_1;
 
-    std::thread        uart_input_thread(uart_input,std::ref(uart));
+    host_clock clock(timebase_freq);
+    uint64_t sync_cnt = 0;
 
     rv_0.jump(0x80000000);
     rv_1.jump(0x80000000);
     rv_1.set_GPR(10,1);
-    // char uart_history[8] = {0};
-    // int uart_history_idx = 0;
-    bool delay_cr = false;
+
+    // Checkpoints cover the fixed machine, the state of the virtio devices and their backends is not saved.
+    bool has_virtio = blk || vcon || backend;
+    auto machine_state = [&](checkpoint &cp) {
+        events.serialize(cp);
+        system_bus.serialize(cp);
+        clint.serialize(cp);
+        plic.serialize(cp);
+        uart.serialize(cp);
+        rv_0.serialize(cp);
+        rv_1.serialize(cp);
+    };
+    auto machine_checkpoint = [&](const char *path, checkpoint::mode_t mode) {
+        if (has_virtio) {
+            std::cerr << "checkpoints are not supported with virtio devices" << std::endl;
+            return false;
+        }
+        checkpoint cp(path, mode);
+        machine_state(cp);
+        dram.serialize(cp);
+        if (!cp.good()) std::cerr << "failed to " << (mode == checkpoint::SAVE ? "save" : "restore") << " checkpoint " << path << std::endl;
+        return cp.good();
+    };
+    if (restore_path) {
+        if (!machine_checkpoint(restore_path, checkpoint::RESTORE)) return 1;
+        clock.set_now(events.now());
+    }
+
+    // host input goes to hvc0 when the virtio console is present, output of both is shown
+    auto start_input = [&]() {
+        return vcon ? std::thread(uart_input<virtio_console>,std::ref(*vcon),std::ref(clock))
+                    : std::thread(uart_input<uartlite>,std::ref(uart),std::ref(clock));
+    };
+    // Test cases and replayed logs replace host input. When fuzzing or recording the emulation
+    // thread drains the UART itself, so the TX status the guest sees does not depend on host timing.
+    std::thread        uart_input_thread = fuzz_dir || replay_path ? std::thread()
+                                         : record_path ? std::thread(uart_input<input_log>,std::ref(*input),std::ref(clock))
+                                         : start_input();
+    console_output     console(console_output::NEWLINE_CRLF_TO_LF);
+    if (!fuzz_dir && !input) console.attach(uart);
+    auto uart_put = [&](const char *buf, size_t len) { return uart.try_putc(buf, len); };
+    // Fuzz cases for the UART, fed from the emulation thread as the rx FIFO drains since only the guest empties it
+    std::vector<char> uart_backlog;
+    if (vcon) console.attach(*vcon);
+
+    // Each test case starts from the reset point: the device and hart state is restored from
+    // memory and only the RAM pages written by the previous case are copied back.
+    std::vector<char> fuzz_state;
+    size_t fuzz_next = 0;
+    uint64_t fuzz_case_start = 0, fuzz_crashes = 0, fuzz_hangs = 0;
+    auto fuzz_begin = std::chrono::steady_clock::now();
+    auto fuzz_start_case = [&]() {
+        if (fuzz_next == fuzz_cases.size()) {
+            double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - fuzz_begin).count();
+            std::cout.flush();
+            std::cerr << "fuzz: " << fuzz_cases.size() << " cases, " << fuzz_crashes << " crashes, " << fuzz_hangs
+                      << " hangs, " << (uint64_t)(fuzz_cases.size() / secs) << " runs/s" << std::endl;
+            exit(fuzz_crashes || fuzz_hangs ? 1 : 0);
+        }
+        checkpoint cp(fuzz_state, checkpoint::RESTORE);
+        machine_state(cp);
+        dram.reset();
+        uart_backlog.clear();
+        std::ifstream file(fuzz_cases[fuzz_next++], std::ios::in | std::ios::binary);
+        std::vector<char> input((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        if (fuzz_addr) {
+            // the input goes to guest memory and its length to a1 of hart 0
+            if (!dram.do_write(fuzz_addr - 0x80000000, input.size(), input.data())) std::cerr << "fuzz: input does not fit at -fuzz-addr" << std::endl;
+            rv_0.set_GPR(11, input.size());
+        }
+        else uart_backlog = input;
+        fuzz_case_start = events.now();
+    };
+    auto fuzz_report = [&](const char *what) {
+        std::cerr << "fuzz: " << fuzz_cases[fuzz_next - 1].string() << " " << what << " after " << events.now() - fuzz_case_start << " ticks" << std::endl;
+    };
+
     while (1) {
-        clint.tick();
-        plic.update_ext(1,uart.irq());
+        if (!realtime) events.tick();
+        else if ((++sync_cnt & 1023) == 0) {
+            // mtime follows the host clock, sampled every 1024 steps
+            events.set_time(clock.now());
+        }
         rv_0.step(plic.get_int(0),clint.m_s_irq(0),clint.m_t_irq(0),plic.get_int(1));
         rv_1.step(plic.get_int(2),clint.m_s_irq(1),clint.m_t_irq(1),plic.get_int(3));
-        while (uart.exist_tx()) {
-            char c = uart.getc();
-            if (c == '\r') delay_cr = true;
-            else {
-                if (delay_cr && c != '\n') std::cout << "\r" << c;
-                else std::cout << c;
+        if (rv_0.is_idle() && rv_1.is_idle()) {
+            // all harts are waiting for interrupts, jump to the next timer event
+            uint64_t ticks = events.next_event();
+            if (realtime) {
+                // block on the host until the next deadline or console input
+                clock.wait_until(ticks == UINT64_MAX ? UINT64_MAX : events.now() + ticks);
+                events.set_time(clock.now());
+            }
+            else if (ticks == UINT64_MAX) {
+                // Nothing changes while waiting for input. A replay need not wait for the host, and a
+                // fuzzed case gets no more input, so it skips to its hang deadline.
+                uint64_t hang_at = fuzz_case_start + fuzz_ticks;
+                if (fuzz_dir && !fuzz_state.empty() && uart_backlog.empty() && hang_at > events.now() + 1) {
+                    uint64_t skip = hang_at - events.now() - 1;
+                    events.advance(skip);
+                    rv_0.advance(skip);
+                    rv_1.advance(skip);
+                }
+                else if (!replay_path && !fuzz_dir) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            else if (ticks > 1) {
+                events.advance(ticks - 1);
+                rv_0.advance(ticks - 1);
+                rv_1.advance(ticks - 1);
+            }
+        }
+        if (save_path && (save_requested || (save_at && events.now() >= save_at))) {
+            if (machine_checkpoint(save_path, checkpoint::SAVE)) std::cerr << "checkpoint saved to " << save_path << std::endl;
+            save_requested = false;
+            save_at = 0;
+        }
+        if (fuzz_dir) {
+            while (uart.exist_tx()) {
+                char c = uart.getc();
+                if (fuzz_state.empty()) std::cout << c; // guest output is shown up to the reset point
+            }
+            uint64_t pc = rv_0.getPC();
+            if (pc == fuzz_at && fuzz_state.empty()) {
                 std::cout.flush();
-                delay_cr = false;
+                checkpoint cp(fuzz_state, checkpoint::SAVE);
+                machine_state(cp);
+                dram.set_reset_point();
+                fuzz_begin = std::chrono::steady_clock::now();
+                fuzz_start_case();
+            }
+            else if (pc == fuzz_at) fuzz_start_case(); // the harness came back for the next input
+            else if (!fuzz_state.empty() && fuzz_crash && pc == fuzz_crash) {
+                fuzz_crashes++;
+                fuzz_report("crashed");
+                fuzz_start_case();
+            }
+            else if (!fuzz_state.empty() && events.now() - fuzz_case_start >= fuzz_ticks) {
+                fuzz_hangs++;
+                fuzz_report("hung");
+                fuzz_start_case();
+            }
+        }
+        if (snapshots && (rewind_requested || events.now() >= next_snapshot)) {
+            if (rewind_requested) {
+                rewind_requested = false;
+                console.flush();
+                if (!snapshots->rewind()) std::cerr << "no snapshot to rewind to" << std::endl;
+            }
+            else {
+                next_snapshot = events.now() + snapshot_every;
+                if (snapshots->take(events.now())) {
+                    // resumed by a rewind, fork() copied only this thread
+                    std::cerr << "rewound to tick " << events.now() << std::endl;
+                    console.restart_after_fork();
+                    clock.restart_after_fork();
+                    clock.set_now(events.now());
+                    start_input().detach();
+                }
+            }
+        }
+        if (input) {
+            if (input->due(events.now())) {
+                input->deliver(events.now(), uart_put);
+                if (input->finished()) std::cerr << "replay finished at tick " << events.now() << std::endl;
+            }
+            bool out = false;
+            while (uart.exist_tx()) {
+                char c = uart.getc();
+                if (c != '\r') std::cout << c;
+                out = true;
             }
-            // uart_history[uart_history_idx] = c;
-            // uart_history_idx = (uart_history_idx + 1) % 8;
+            if (out) std::cout.flush();
         }
         if (send_ctrl_c) {
-            uart.putc(3);
+            if (input) input->inject(events.now(), "\x03", 1, uart_put);
+            else if (fuzz_dir) uart_backlog.push_back(3); // no input thread feeds the uart
+            else keyboard.send_ctrl_c();
             send_ctrl_c = false;
         }
+        if (!uart_backlog.empty()) uart_backlog.erase(uart_backlog.begin(), uart_backlog.begin() + uart_put(uart_backlog.data(), uart_backlog.size()));
         //printf("%lx %lx\n",rv_0.getPC(),rv_1.getPC());
     }
     return 0;
@@ -0,0 +1,126 @@
+#ifndef DEVICE_MAP_HPP
+#define DEVICE_MAP_HPP
+
+#include "mmio_dev.hpp"
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <functional>
+
+// Address decoder shared by the buses. Devices are kept in an array sorted by base address
+// and the last hit is cached, so RAM accesses and instruction fetches decode with two compares.
+// The last DMI region obtained is cached too, accesses inside it are a plain memcpy.
+class device_map {
+public:
+    device_map() {
+        last = {0, 0, nullptr, false};
+        clear_dmi();
+    }
+    bool add(uint64_t start_addr, uint64_t length, mmio_dev *dev, bool raw_addr) {
+        if (length == 0 || start_addr % length) return false;
+        entry e = {start_addr, start_addr + length, dev, raw_addr};
+        auto it = std::upper_bound(devices.begin(), devices.end(), start_addr, [](uint64_t addr, const entry &x) {
+            return addr < x.start;
+        });
+        if (it != devices.end() && it->start < e.end) return false; // overlap
+        if (it != devices.begin() && std::prev(it)->end > e.start) return false; // overlap
+        devices.insert(it, e);
+        dev->add_dmi_listener([this]() {
+            clear_dmi();
+            if (dmi_listener) dmi_listener();
+        });
+        return true;
+    }
+    bool read(uint64_t addr, uint64_t size, char *buffer) {
+        if (dmi.read && dmi.start <= addr && addr + size <= dmi.end) {
+            memcpy(buffer, dmi.ptr + (addr - dmi.start), size);
+            return true;
+        }
+        uint64_t dev_addr;
+        mmio_dev *dev = find(addr, size, dev_addr);
+        return dev && dev->do_read(dev_addr, size, buffer);
+    }
+    bool write(uint64_t addr, uint64_t size, const char *buffer) {
+        if (dmi.write && dmi.start <= addr && addr + size <= dmi.end) {
+            memcpy(dmi.ptr + (addr - dmi.start), buffer, size);
+            if (dmi.dirty) dmi.mark_dirty(dmi.ptr + (addr - dmi.start), size);
+            return true;
+        }
+        uint64_t dev_addr;
+        mmio_dev *dev = find(addr, size, dev_addr);
+        return dev && dev->do_write(dev_addr, size, buffer);
+    }
+    template <typename T>
+    bool read(uint64_t addr, T &value) {
+        if (dmi.read && dmi.start <= addr && addr + sizeof(T) <= dmi.end) {
+            memcpy(&value, dmi.ptr + (addr - dmi.start), sizeof(T));
+            return true;
+        }
+        return read(addr, sizeof(T), (char*)&value);
+    }
+    template <typename T>
+    bool write(uint64_t addr, T value) {
+        if (dmi.write && dmi.start <= addr && addr + sizeof(T) <= dmi.end) {
+            memcpy(dmi.ptr + (addr - dmi.start), &value, sizeof(T));
+            if (dmi.dirty) dmi.mark_dirty(dmi.ptr + (addr - dmi.start), sizeof(T));
+            return true;
+        }
+        return write(addr, sizeof(T), (const char*)&value);
+    }
+    // DMI region around addr in bus addresses.
+    bool get_dmi(uint64_t addr, dmi_region &region) {
+        uint64_t dev_addr;
+        if (!find(addr, 1, dev_addr)) return false;
+        return clip_dmi(last.dev, last.start, last.end, last.raw_addr, addr, region);
+    }
+    // Called after any device revoked its regions, the bus passes it on to its own users.
+    void set_dmi_listener(std::function<void()> listener) {
+        dmi_listener = listener;
+    }
+    // Ask dev, mapped at [start, end), for its region around bus address addr and clip it to the window.
+    static bool clip_dmi(mmio_dev *dev, uint64_t start, uint64_t end, bool raw_addr, uint64_t addr, dmi_region &region) {
+        uint64_t offset = raw_addr ? 0 : start; // bus address - device address
+        if (!dev->get_dmi(addr - offset, region)) return false;
+        uint64_t clip_start = std::max(region.start + offset, start);
+        uint64_t clip_end = std::min(region.end + offset, end);
+        region.ptr += clip_start - (region.start + offset);
+        region.start = clip_start;
+        region.end = clip_end;
+        return clip_start <= addr && addr < clip_end;
+    }
+private:
+    struct entry {
+        uint64_t start;
+        uint64_t end;
+        mmio_dev *dev;
+        bool raw_addr;
+    };
+    // Device covering [addr, addr + size), dev_addr receives the address to pass to it.
+    mmio_dev *find(uint64_t addr, uint64_t size, uint64_t &dev_addr) {
+        if (!(last.start <= addr && addr + size <= last.end)) {
+            auto it = std::upper_bound(devices.begin(), devices.end(), addr, [](uint64_t addr, const entry &x) {
+                return addr < x.start;
+            });
+            if (it == devices.begin()) return nullptr;
+            it = std::prev(it);
+            if (!(it->start <= addr && addr + size <= it->end)) return nullptr;
+            last = *it;
+            // remember the region of memory-like devices, MMIO devices leave it alone
+            dmi_region region;
+            if (clip_dmi(last.dev, last.start, last.end, last.raw_addr, addr, region)) dmi = region;
+        }
+        // bases are aligned to the device size, so the offset is addr % size
+        dev_addr = last.raw_addr ? addr : addr - last.start;
+        return last.dev;
+    }
+    void clear_dmi() {
+        dmi = dmi_region();
+    }
+    std::vector<entry> devices;
+    entry last;
+    dmi_region dmi;
+    std::function<void()> dmi_listener;
+};
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef LZ_BLOCK_HPP
+#define LZ_BLOCK_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+// Byte oriented LZ77 for blocks of up to a few MiB, in the spirit of LZ4. A block is a list of
+// sequences, each a token byte (literal count in the high nibble, match length - 4 in the low
+// nibble, 15 meaning more length bytes follow), the literals, a 16 bit little endian offset and
+// the extra match length bytes. The last sequence has literals only. Greedy single probe
+// matching, fast rather than small.
+
+static const unsigned int lz_hash_bits = 14;
+static const size_t lz_min_match = 4;
+
+// Worst case compressed size of len bytes.
+inline size_t lz_bound(size_t len) {
+    return len + len / 255 + 16;
+}
+
+// Compresses len bytes of src into dst, which holds lz_bound(len) bytes. Returns the compressed size.
+inline size_t lz_compress(const char *src, size_t len, char *dst) {
+    const uint8_t *in = (const uint8_t*)src, *end = in + len;
+    const uint8_t *ip = in, *anchor = in;
+    uint8_t *op = (uint8_t*)dst;
+    static thread_local uint32_t table[1 << lz_hash_bits];
+    memset(table, 0, sizeof(table));
+    auto load32 = [](const uint8_t *p) { uint32_t v; memcpy(&v, p, 4); return v; };
+    auto hash = [](uint32_t v) { return (v * 2654435761u) >> (32 - lz_hash_bits); };
+    auto put_len = [&op](size_t n) {
+        while (n >= 255) {
+            *op++ = 255;
+            n -= 255;
+        }
+        *op++ = n;
+    };
+    auto put_literals = [&](size_t lits, uint8_t match_nibble) {
+        *op++ = (lits < 15 ? lits : 15) << 4 | match_nibble;
+        if (lits >= 15) put_len(lits - 15);
+        memcpy(op, anchor, lits);
+        op += lits;
+    };
+    unsigned int misses = 0;
+    while (ip + lz_min_match <= end) {
+        uint32_t v = load32(ip);
+        uint32_t h = hash(v);
+        const uint8_t *cand = in + table[h];
+        table[h] = ip - in;
+        if (cand >= ip || ip - cand > 0xffff || load32(cand) != v) {
+            ip += 1 + (misses++ >> 6); // skip faster through data that does not compress
+            continue;
+        }
+        misses = 0;
+        size_t match = lz_min_match;
+        while (ip + match < end && cand[match] == ip[match]) match++;
+        size_t extra = match - lz_min_match;
+        put_literals(ip - anchor, extra < 15 ? extra : 15);
+        uint16_t offset = ip - cand;
+        *op++ = offset & 0xff;
+        *op++ = offset >> 8;
+        if (extra >= 15) put_len(extra - 15);
+        ip += match;
+        anchor = ip;
+    }
+    put_literals(end - anchor, 0);
+    return op - (uint8_t*)dst;
+}
+
+// Decompresses a block that must expand to exactly out_len bytes. Returns false on corrupt input.
+inline bool lz_decompress(const char *src, size_t len, char *dst, size_t out_len) {
+    const uint8_t *ip = (const uint8_t*)src, *iend = ip + len;
+    uint8_t *out = (uint8_t*)dst, *op = out, *oend = out + out_len;
+    auto get_len = [&ip, iend](size_t &n) {
+        uint8_t b;
+        do {
+            if (ip >= iend) return false;
+            b = *ip++;
+            n += b;
+        } while (b == 255);
+        return true;
+    };
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t lits = token >> 4;
+        if (lits == 15 && !get_len(lits)) return false;
+        if (lits > (size_t)(iend - ip) || lits > (size_t)(oend - op)) return false;
+        memcpy(op, ip, lits);
+        ip += lits;
+        op += lits;
+        if (ip == iend) break;
+        if (iend - ip < 2) return false;
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        size_t match = token & 15;
+        if (match == 15 && !get_len(match)) return false;
+        match += lz_min_match;
+        if (offset == 0 || offset > (size_t)(op - out) || match > (size_t)(oend - op)) return false;
+        const uint8_t *from = op - offset;
+        if (offset >= match) memcpy(op, from, match);
+        else for (size_t i = 0; i < match; i++) op[i] = from[i]; // overlapping run
+        op += match;
+    }
+    return op == oend;
+}
+
+#endif
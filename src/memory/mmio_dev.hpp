@@ -2,12 +2,49 @@
 #define MEMORY_HPP
 
 #include <cstdint>
+#include <vector>
+#include <functional>
+
+// Direct memory interface, host memory backing device addresses [start, end).
+// ptr points at the byte of address start.
+struct dmi_region {
+    static const unsigned int dirty_page_bits = 12;
+    char *ptr;
+    uint64_t start;
+    uint64_t end;
+    bool read;
+    bool write;
+    // When set, direct writes must set the bits of the pages they touch. Bit n of the bitmap
+    // is the page at dirty_base + (n << dirty_page_bits).
+    uint64_t *dirty = nullptr;
+    char *dirty_base = nullptr;
+    void mark_dirty(const char *p, uint64_t size) const {
+        uint64_t first = (p - dirty_base) >> dirty_page_bits;
+        uint64_t last = (p + size - 1 - dirty_base) >> dirty_page_bits;
+        for (uint64_t page = first; page <= last; page++) dirty[page / 64] |= 1ull << (page % 64);
+    }
+};
 
 class mmio_dev {
 public:
     virtual bool do_read (uint64_t start_addr, uint64_t size, char* buffer) = 0;
     virtual bool do_write(uint64_t start_addr, uint64_t size, const char* buffer) = 0;
+    // Memory-like devices return the region around addr that may be accessed directly.
+    // Users may cache it until the device calls invalidate_dmi().
+    virtual bool get_dmi(uint64_t addr, dmi_region &region) {
+        return false;
+    }
+    void add_dmi_listener(std::function<void()> listener) {
+        dmi_listeners.push_back(listener);
+    }
     virtual ~mmio_dev() {}
+protected:
+    // Revoke every region handed out so far.
+    void invalidate_dmi() {
+        for (auto &listener : dmi_listeners) listener();
+    }
+private:
+    std::vector<std::function<void()> > dmi_listeners;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -2,39 +2,62 @@
 #define RAM_HPP
 
 #include "mmio_dev.hpp"
+#include "checkpoint.hpp"
+#include "ram_image.hpp"
 #include <cstring>
 #include <fstream>
 #include <filesystem>
 #include <iostream>
+#include <new>
+#include <vector>
+#include <memory>
+#include <algorithm>
 #include <assert.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 
+// Guest memory is an anonymous MAP_NORESERVE mapping, pages cost host memory only once
+// the guest touches them and read as zero until then.
+// Writes are tracked in a bitmap of dirty pages, including direct writes through get_dmi.
 class ram: public mmio_dev {
 public:
+    static const uint64_t dirty_page_size = 1ull << dmi_region::dirty_page_bits;
     ram(uint64_t size_bytes) {
-        mem = new char[size_bytes];
+        void *p = mmap(nullptr, size_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED) throw std::bad_alloc();
+        mem = (char*)p;
         mem_size = size_bytes;
+        dirty.resize((size_bytes / dirty_page_size + 63) / 64);
+    }
+    ram(const ram&) = delete;
+    ram &operator=(const ram&) = delete;
+    ~ram() {
+        munmap(mem, mem_size);
     }
     ram(uint64_t size_bytes, const char *init_binary, uint64_t init_binary_len):ram(size_bytes) {
         assert(init_binary_len <= size_bytes);
         memcpy(mem,init_binary,init_binary_len);
+        mark_dirty(0,init_binary_len);
     }
     ram(uint64_t size_bytes, const char *init_file):ram(size_bytes) {
-        uint64_t file_size = std::filesystem::file_size(init_file);
-        if (file_size > mem_size) {
-            std::cerr << "ram size is not big enough for init file." << std::endl;
-            file_size = size_bytes;
-        }
-        std::ifstream file(init_file,std::ios::in | std::ios::binary);
-        file.read((char*)mem,file_size);
+        load_binary(0, init_file);
     }
+    // Whole pages of the image are mapped copy-on-write instead of copied, they are read from
+    // the host page cache on first access and shared between instances until the guest writes
+    // them. The image file should not be modified while it is mapped.
     void load_binary(uint64_t start_addr, const char *init_file) {
+        assert(start_addr <= mem_size);
         uint64_t file_size = std::filesystem::file_size(init_file);
-        if (file_size > mem_size) {
+        if (file_size > mem_size - start_addr) {
             std::cerr << "ram size is not big enough for init file." << std::endl;
-            file_size = mem_size;
+            file_size = mem_size - start_addr;
         }
+        uint64_t mapped = map_file(start_addr, file_size, init_file);
         std::ifstream file(init_file,std::ios::in | std::ios::binary);
-        file.read((char*)mem+start_addr,file_size);
+        file.seekg(mapped);
+        file.read((char*)mem+start_addr+mapped,file_size-mapped);
+        mark_dirty(start_addr,file_size);
     }
     void load_text(uint64_t start_addr, const char *init_file) {
         uint64_t file_size = 0;
@@ -43,6 +66,7 @@ public:
         while (std::getline(file, line)) {
             uint32_t x = std::stoul(line, nullptr, 16);
             *(mem + start_addr + file_size) = x;
+            mark_dirty(start_addr + file_size,1);
             file_size++;
             if (file_size > mem_size) {
                 std::cerr << "ram size is not big enough for init file." << std::endl;
@@ -68,25 +92,136 @@ public:
     bool do_write(uint64_t start_addr, uint64_t size, const char* buffer) {
         if (start_addr + size <= mem_size) {
             memcpy(&mem[start_addr],buffer,size);
+            mark_dirty(start_addr,size);
             return true;
         }
         else if (allow_warp) {
             start_addr %= mem_size;
             if (start_addr + size <= mem_size) {
                 memcpy(&mem[start_addr],buffer,size);
+                mark_dirty(start_addr,size);
                 return true;
             }
             else return false;
         }
         else return false;
     }
+    template <typename T>
+    bool read(uint64_t addr, T &value) {
+        if (addr + sizeof(T) > mem_size) return do_read(addr, sizeof(T), (char*)&value);
+        memcpy(&value, &mem[addr], sizeof(T));
+        return true;
+    }
+    template <typename T>
+    bool write(uint64_t addr, T value) {
+        if (addr + sizeof(T) > mem_size) return do_write(addr, sizeof(T), (const char*)&value);
+        memcpy(&mem[addr], &value, sizeof(T));
+        mark_dirty(addr, sizeof(T));
+        return true;
+    }
+    bool get_dmi(uint64_t addr, dmi_region &region) {
+        if (addr >= mem_size) return false;
+        region = {mem, 0, mem_size, true, true};
+        region.dirty = dirty.data();
+        region.dirty_base = mem;
+        return true;
+    }
+    // Whether the page containing addr was written since the last clear_dirty().
+    bool is_dirty(uint64_t addr) {
+        uint64_t page = addr / dirty_page_size;
+        return dirty[page / 64] >> (page % 64) & 1;
+    }
+    // Calls f(addr) with the address of each dirty page in ascending order.
+    template <typename F>
+    void for_each_dirty(F f) {
+        for (uint64_t i = 0; i < dirty.size(); i++) {
+            uint64_t bits = dirty[i];
+            while (bits) {
+                uint64_t page = i * 64 + __builtin_ctzll(bits);
+                f(page * dirty_page_size);
+                bits &= bits - 1;
+            }
+        }
+    }
+    uint64_t dirty_count() {
+        uint64_t count = 0;
+        for (uint64_t bits : dirty) count += __builtin_popcountll(bits);
+        return count;
+    }
+    void clear_dirty() {
+        std::fill(dirty.begin(), dirty.end(), 0);
+    }
+    // The contents are stored as a ram_image, zero and duplicate pages take no space.
+    void serialize(checkpoint &cp) {
+        cp.section("ram");
+        uint64_t size = mem_size;
+        cp.io(size);
+        if (size != mem_size) {
+            cp.fail("ram size differs");
+            return;
+        }
+        if (cp.saving()) ram_image::save(cp, mem, mem_size);
+        else ram_image::load(cp, mem, mem_size, [this](uint64_t addr) { mark_dirty(addr, ram_image::page_size); });
+    }
+    // Keep the current contents as the state reset() goes back to. Only pages with data are copied.
+    void set_reset_point() {
+        uint64_t pages = (mem_size + dirty_page_size - 1) / dirty_page_size;
+        reset_pages.clear();
+        reset_pages.resize(pages);
+        for (uint64_t i = 0; i < pages; i++) {
+            uint64_t len = std::min(dirty_page_size, mem_size - i * dirty_page_size);
+            const char *page = mem + i * dirty_page_size;
+            if (std::all_of(page, page + len, [](char c) { return c == 0; })) continue;
+            reset_pages[i].reset(new char[len]);
+            memcpy(reset_pages[i].get(), page, len);
+        }
+        clear_dirty();
+    }
+    // Copy back the pages written since set_reset_point() or the last reset(), returns how many.
+    uint64_t reset() {
+        uint64_t count = 0;
+        for_each_dirty([&](uint64_t addr) {
+            uint64_t len = std::min(dirty_page_size, mem_size - addr);
+            const char *saved = reset_pages[addr / dirty_page_size].get();
+            if (saved) memcpy(mem + addr, saved, len);
+            else memset(mem + addr, 0, len);
+            count++;
+        });
+        clear_dirty();
+        return count;
+    }
+    char *data() {
+        return mem;
+    }
+    uint64_t size() {
+        return mem_size;
+    }
     void set_allow_warp(bool value) {
         allow_warp = true;
     }
 private:
+    void mark_dirty(uint64_t start_addr, uint64_t size) {
+        if (size == 0) return;
+        uint64_t first = start_addr / dirty_page_size;
+        uint64_t last = (start_addr + size - 1) / dirty_page_size;
+        for (uint64_t page = first; page <= last; page++) dirty[page / 64] |= 1ull << (page % 64);
+    }
+    // Map the page aligned part of the first len bytes of path at start_addr, returns the bytes mapped.
+    uint64_t map_file(uint64_t start_addr, uint64_t len, const char *path) {
+        uint64_t page_size = sysconf(_SC_PAGESIZE);
+        uint64_t map_len = len / page_size * page_size; // the partial last page is copied
+        if (start_addr % page_size || map_len == 0) return 0;
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) return 0;
+        void *p = mmap(mem + start_addr, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0);
+        close(fd);
+        return p == MAP_FAILED ? 0 : map_len;
+    }
     bool allow_warp = false;
     char *mem;
     uint64_t mem_size;
+    std::vector<uint64_t> dirty;
+    std::vector<std::unique_ptr<char[]> > reset_pages; // null for zero pages
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,258 @@
+#ifndef RAM_IMAGE_HPP
+#define RAM_IMAGE_HPP
+
+#include "checkpoint.hpp"
+#include "lz_block.hpp"
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <unordered_map>
+#include <algorithm>
+
+// Compact image of guest memory inside a checkpoint. Every 4KiB page is either zero, a copy of
+// an earlier page found by hash, or data. Data pages are packed into chunks that worker threads
+// compress with lz_block while the previous batch of chunks is written, loading reads the next
+// batch while the current one is decompressed. A mostly empty 2GiB guest saves in a few MiB.
+//
+// Layout: page size, page count, the LZ compressed page map (one uint32_t per page, zero_page,
+// data_page or the index of the page it duplicates), chunk size in pages, then for each chunk
+// its compressed length and the compressed data pages in ascending address order.
+class ram_image {
+public:
+    static const uint64_t page_size = 4096;
+    static const uint32_t chunk_pages = 64;
+    static const uint32_t zero_page = 0xffffffff;
+    static const uint32_t data_page = 0xfffffffe;
+
+    static void save(checkpoint &cp, const char *mem, uint64_t size) {
+        cp.section("ram image");
+        uint64_t geometry[2] = {page_size, pages_of(size)};
+        cp.io(geometry);
+        if (geometry[1] >= data_page) {
+            cp.fail("ram too large for image");
+            return;
+        }
+        uint32_t pages = geometry[1];
+        std::vector<uint32_t> map(pages);
+        std::vector<uint64_t> hashes(pages);
+        parallel_for(pages, [&](uint32_t i) {
+            const char *page = mem + i * page_size;
+            hashes[i] = is_zero(page, page_len(i, size)) ? 0 : hash(page, page_len(i, size));
+        }, 64);
+        std::unordered_map<uint64_t, uint32_t> first_seen;
+        std::vector<uint32_t> data;
+        for (uint32_t i = 0; i < pages; i++) {
+            if (hashes[i] == 0) {
+                map[i] = zero_page;
+                continue;
+            }
+            auto seen = first_seen.emplace(hashes[i], i);
+            uint32_t first = seen.first->second;
+            if (!seen.second && page_len(first, size) == page_len(i, size) &&
+                memcmp(mem + first * page_size, mem + i * page_size, page_len(i, size)) == 0) {
+                map[i] = first;
+            }
+            else {
+                map[i] = data_page;
+                data.push_back(i);
+            }
+        }
+        std::string packed_map = compress((const char*)map.data(), map.size() * sizeof(uint32_t));
+        uint64_t map_len = packed_map.size();
+        cp.io(map_len);
+        cp.io(&packed_map[0], map_len);
+        uint32_t chunk = chunk_pages;
+        cp.io(chunk);
+
+        uint64_t chunks = (data.size() + chunk_pages - 1) / chunk_pages;
+        uint64_t batch = workers() * 4;
+        std::vector<std::string> out[2];
+        for (uint64_t first = 0; first < chunks + batch && cp.good(); first += batch) {
+            std::vector<std::string> &cur = out[first / batch % 2], &prev = out[(first / batch + 1) % 2];
+            uint64_t count = first < chunks ? std::min(batch, chunks - first) : 0;
+            cur.assign(count, std::string());
+            std::thread worker([&]() {
+                parallel_for(count, [&](uint64_t c) {
+                    std::string raw;
+                    for (uint64_t j = (first + c) * chunk_pages; j < std::min<uint64_t>((first + c + 1) * chunk_pages, data.size()); j++) {
+                        raw.append(mem + data[j] * page_size, page_len(data[j], size));
+                    }
+                    cur[c] = compress(raw.data(), raw.size());
+                });
+            });
+            for (std::string &packed : prev) {
+                uint32_t len = packed.size();
+                cp.io(len);
+                cp.io(&packed[0], len);
+            }
+            prev.clear();
+            worker.join();
+        }
+    }
+
+    // Pages already holding the right content are left untouched, so copy-on-write mappings
+    // stay shared and pages that stay zero take no host memory. changed(addr) is called for
+    // every page written, from the calling thread.
+    template <typename F>
+    static void load(checkpoint &cp, char *mem, uint64_t size, F changed) {
+        cp.section("ram image");
+        uint64_t geometry[2];
+        cp.io(geometry);
+        if (!cp.good()) return;
+        if (geometry[0] != page_size || geometry[1] != pages_of(size)) {
+            cp.fail("ram image geometry differs");
+            return;
+        }
+        uint32_t pages = geometry[1];
+        uint64_t map_len;
+        cp.io(map_len);
+        if (!cp.good() || map_len > lz_bound(pages * sizeof(uint32_t))) {
+            cp.fail("corrupt ram image map");
+            return;
+        }
+        std::string packed_map(map_len, '\0');
+        cp.io(&packed_map[0], map_len);
+        std::vector<uint32_t> map(pages);
+        if (cp.good() && !lz_decompress(packed_map.data(), map_len, (char*)map.data(), pages * sizeof(uint32_t))) {
+            cp.fail("corrupt ram image map");
+        }
+        if (!cp.good()) return;
+        std::vector<uint32_t> data;
+        for (uint32_t i = 0; i < pages; i++) {
+            if (map[i] == data_page) data.push_back(i);
+            else if (map[i] != zero_page && (map[i] >= i || map[map[i]] != data_page)) {
+                cp.fail("corrupt ram image map");
+            }
+        }
+        uint32_t chunk;
+        cp.io(chunk);
+        if (!cp.good()) return;
+        if (chunk == 0 || chunk > 1024) {
+            cp.fail("corrupt ram image chunk size");
+            return;
+        }
+
+        std::vector<char> updated(pages);
+        std::atomic<bool> corrupt(false);
+        auto store = [&](uint32_t i, const char *content) {
+            uint64_t len = page_len(i, size);
+            char *page = mem + i * page_size;
+            if (content ? memcmp(page, content, len) == 0 : is_zero(page, len)) return;
+            if (content) memcpy(page, content, len);
+            else memset(page, 0, len);
+            updated[i] = 1;
+        };
+        uint64_t chunks = (data.size() + chunk - 1) / chunk;
+        uint64_t batch = workers() * 4;
+        std::vector<std::string> in[2];
+        for (uint64_t first = 0; first < chunks + batch && cp.good(); first += batch) {
+            std::vector<std::string> &cur = in[first / batch % 2], &prev = in[(first / batch + 1) % 2];
+            uint64_t prev_first = first - batch;
+            std::thread worker([&]() {
+                parallel_for(prev.size(), [&](uint64_t c) {
+                    uint64_t begin = (prev_first + c) * chunk;
+                    uint64_t end = std::min<uint64_t>(begin + chunk, data.size());
+                    uint64_t raw_len = 0;
+                    for (uint64_t j = begin; j < end; j++) raw_len += page_len(data[j], size);
+                    std::vector<char> raw(raw_len);
+                    if (!lz_decompress(prev[c].data(), prev[c].size(), raw.data(), raw_len)) {
+                        corrupt = true;
+                        return;
+                    }
+                    const char *content = raw.data();
+                    for (uint64_t j = begin; j < end; j++) {
+                        store(data[j], content);
+                        content += page_len(data[j], size);
+                    }
+                });
+            });
+            uint64_t count = first < chunks ? std::min(batch, chunks - first) : 0;
+            cur.assign(count, std::string());
+            for (std::string &packed : cur) {
+                uint32_t len;
+                cp.io(len);
+                if (!cp.good() || len > lz_bound(chunk * page_size)) {
+                    cp.fail("corrupt ram image chunk");
+                    break;
+                }
+                packed.resize(len);
+                cp.io(&packed[0], len);
+            }
+            worker.join();
+            prev.clear();
+        }
+        if (corrupt) cp.fail("corrupt ram image chunk");
+        if (!cp.good()) return;
+        // Duplicates last, their sources are data pages restored above.
+        parallel_for(pages, [&](uint32_t i) {
+            if (map[i] == zero_page) store(i, nullptr);
+            else if (map[i] != data_page) store(i, mem + map[i] * page_size);
+        }, 64);
+        for (uint32_t i = 0; i < pages; i++) {
+            if (updated[i]) changed(i * page_size);
+        }
+    }
+
+private:
+    static uint64_t pages_of(uint64_t size) {
+        return (size + page_size - 1) / page_size;
+    }
+    static uint64_t page_len(uint64_t i, uint64_t size) {
+        return std::min(page_size, size - i * page_size);
+    }
+    static bool is_zero(const char *p, uint64_t len) {
+        uint64_t acc = 0;
+        uint64_t i = 0;
+        for (; i + 8 <= len; i += 8) {
+            uint64_t v;
+            memcpy(&v, p + i, 8);
+            acc |= v;
+        }
+        for (; i < len; i++) acc |= (uint8_t)p[i];
+        return acc == 0;
+    }
+    // Nonzero for any page with content, zero marks zero pages.
+    static uint64_t hash(const char *p, uint64_t len) {
+        uint64_t h = 0xcbf29ce484222325ull;
+        for (uint64_t i = 0; i + 8 <= len; i += 8) {
+            uint64_t v;
+            memcpy(&v, p + i, 8);
+            h = (h ^ v) * 0x100000001b3ull;
+            h ^= h >> 29;
+        }
+        for (uint64_t i = len & ~7ull; i < len; i++) h = (h ^ (uint8_t)p[i]) * 0x100000001b3ull;
+        return h ? h : 1;
+    }
+    static std::string compress(const char *src, size_t len) {
+        std::string packed(lz_bound(len), '\0');
+        packed.resize(lz_compress(src, len, &packed[0]));
+        return packed;
+    }
+    static unsigned int workers() {
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+    // Runs f(i) for i in [0, n) on all host cores, handing out grain indices at a time.
+    template <typename F>
+    static void parallel_for(uint64_t n, F f, uint64_t grain = 1) {
+        unsigned int threads = std::min<uint64_t>(workers(), n);
+        if (threads <= 1) {
+            for (uint64_t i = 0; i < n; i++) f(i);
+            return;
+        }
+        std::atomic<uint64_t> next(0);
+        auto run = [&]() {
+            for (uint64_t i; (i = next.fetch_add(grain)) < n;) {
+                for (uint64_t j = i; j < std::min(i + grain, n); j++) f(j);
+            }
+        };
+        std::vector<std::thread> pool;
+        for (unsigned int t = 1; t < threads; t++) pool.emplace_back(run);
+        run();
+        for (std::thread &t : pool) t.join();
+    }
+};
+
+#endif
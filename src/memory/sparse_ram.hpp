@@ -0,0 +1,133 @@
+#ifndef SPARSE_RAM_HPP
+#define SPARSE_RAM_HPP
+
+#include "mmio_dev.hpp"
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <algorithm>
+#include <assert.h>
+
+// RAM for large and mostly empty physical address spaces. Host pages are allocated on the
+// first write and found through a two-level page table, unwritten pages read as zero. Ranges
+// can alias other ranges of the same device, or be left as holes where accesses fail.
+// Each second-level table covers 2^(page_bits + l2_bits) bytes, 256MiB by default.
+template <unsigned int page_bits = 12, unsigned int l2_bits = 16>
+class sparse_ram : public mmio_dev {
+public:
+    static const uint64_t page_size = 1ull << page_bits;
+    sparse_ram(uint64_t size_bytes):mem_size(size_bytes) {
+        l1.resize((size_bytes + (1ull << (page_bits + l2_bits)) - 1) >> (page_bits + l2_bits));
+    }
+    ~sparse_ram() {
+        for (auto &ref : refs) delete[] ref.first;
+    }
+    bool do_read(uint64_t start_addr, uint64_t size, char* buffer) {
+        if (start_addr >= mem_size || size > mem_size - start_addr) return false;
+        while (size) {
+            uint64_t offset = start_addr & (page_size - 1);
+            uint64_t len = std::min(size, page_size - offset);
+            char *page = get_page(start_addr);
+            if (page == hole()) return false;
+            if (page) memcpy(buffer, page + offset, len);
+            else memset(buffer, 0, len);
+            start_addr += len;
+            buffer += len;
+            size -= len;
+        }
+        return true;
+    }
+    bool do_write(uint64_t start_addr, uint64_t size, const char* buffer) {
+        if (start_addr >= mem_size || size > mem_size - start_addr) return false;
+        while (size) {
+            uint64_t offset = start_addr & (page_size - 1);
+            uint64_t len = std::min(size, page_size - offset);
+            char *page = get_page(start_addr);
+            if (page == hole()) return false;
+            if (!page) page = alloc_page(start_addr);
+            memcpy(page + offset, buffer, len);
+            start_addr += len;
+            buffer += len;
+            size -= len;
+        }
+        return true;
+    }
+    // Only pages already written are offered, so reads of untouched memory allocate nothing.
+    bool get_dmi(uint64_t addr, dmi_region &region) {
+        if (addr >= mem_size) return false;
+        char *page = get_page(addr);
+        if (!page || page == hole()) return false;
+        uint64_t start = addr & ~(page_size - 1);
+        region = {page, start, std::min(start + page_size, mem_size), true, true};
+        return true;
+    }
+    // Make [addr, addr + len) share the host pages of [target, target + len). Both are page aligned.
+    void alias(uint64_t addr, uint64_t target, uint64_t len) {
+        assert(addr % page_size == 0 && target % page_size == 0 && len % page_size == 0);
+        assert(addr + len <= mem_size && target + len <= mem_size);
+        for (uint64_t i = 0; i < len; i += page_size) {
+            char *page = get_page(target + i);
+            if (!page) page = alloc_page(target + i);
+            set_page(addr + i, page);
+        }
+        invalidate_dmi();
+    }
+    // Accesses to [addr, addr + len) fail from now on.
+    void unmap(uint64_t addr, uint64_t len) {
+        assert(addr % page_size == 0 && len % page_size == 0 && addr + len <= mem_size);
+        for (uint64_t i = 0; i < len; i += page_size) set_page(addr + i, hole());
+        invalidate_dmi();
+    }
+    uint64_t size() {
+        return mem_size;
+    }
+    // Host pages reachable from the page table, aliases of a page are counted once.
+    uint64_t resident_pages() {
+        return refs.size();
+    }
+    uint64_t resident_bytes() {
+        return refs.size() * page_size + l2_tables * sizeof(l2_table) + l1.size() * sizeof(l1[0]);
+    }
+private:
+    struct l2_table {
+        char *page[1ull << l2_bits];
+    };
+    // Distinct address used to mark holes in the page table.
+    static char *hole() {
+        static char marker;
+        return &marker;
+    }
+    char *get_page(uint64_t addr) {
+        l2_table *l2 = l1[addr >> (page_bits + l2_bits)].get();
+        return l2 ? l2->page[(addr >> page_bits) & ((1ull << l2_bits) - 1)] : nullptr;
+    }
+    // Host pages are reference counted by table entry and freed when the last one is replaced.
+    void set_page(uint64_t addr, char *page) {
+        std::unique_ptr<l2_table> &l2 = l1[addr >> (page_bits + l2_bits)];
+        if (!l2) {
+            l2.reset(new l2_table());
+            l2_tables ++;
+        }
+        char *&entry = l2->page[(addr >> page_bits) & ((1ull << l2_bits) - 1)];
+        if (entry == page) return;
+        if (page && page != hole()) refs[page] ++;
+        if (entry && entry != hole() && --refs[entry] == 0) {
+            refs.erase(entry);
+            delete[] entry;
+        }
+        entry = page;
+    }
+    char *alloc_page(uint64_t addr) {
+        char *page = new char[page_size]();
+        set_page(addr, page);
+        return page;
+    }
+    uint64_t mem_size;
+    std::vector<std::unique_ptr<l2_table> > l1;
+    std::unordered_map<char*, uint64_t> refs; // host page -> table entries pointing to it
+    uint64_t l2_tables = 0;
+};
+
+#endif
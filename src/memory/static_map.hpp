@@ -0,0 +1,114 @@
+#ifndef STATIC_MAP_HPP
+#define STATIC_MAP_HPP
+
+#include "mmio_dev.hpp"
+#include "device_map.hpp"
+#include <cstdint>
+#include <tuple>
+#include <functional>
+
+// A device window known at compile time: dev_t mapped at [base, base + length).
+template <uint64_t base, uint64_t length, typename dev_t, bool raw_addr = false>
+struct static_range {
+    static_assert(length != 0 && base % length == 0, "static_range base must be aligned to its length");
+    typedef dev_t device_type;
+    static constexpr uint64_t start = base;
+    static constexpr uint64_t end = base + length;
+    static constexpr bool raw = raw_addr;
+};
+
+// Address decoder for a machine whose layout is fixed at compile time. Each range is a constant
+// compare and the device is called without virtual dispatch, so accesses to RAM inline into the
+// core. Ranges are tried in order, list the hot ones first. Devices added at runtime, such as
+// optional virtio devices, go to a device_map that is searched after the static ranges.
+template <typename... ranges>
+class static_map {
+public:
+    static_map(typename ranges::device_type&... devs):devs(devs...) {
+        std::apply([this](auto&... dev) {
+            (dev.add_dmi_listener([this]() { if (dmi_listener) dmi_listener(); }), ...);
+        }, this->devs);
+        dynamic.set_dmi_listener([this]() { if (dmi_listener) dmi_listener(); });
+    }
+    bool add(uint64_t start_addr, uint64_t length, mmio_dev *dev, bool raw_addr) {
+        for (size_t i = 0; i < sizeof...(ranges); i++) {
+            if (start_addr < ends[i] && starts[i] < start_addr + length) return false; // overlap
+        }
+        return dynamic.add(start_addr, length, dev, raw_addr);
+    }
+    bool read(uint64_t addr, uint64_t size, char *buffer) {
+        return read_at<0>(addr, size, buffer);
+    }
+    bool write(uint64_t addr, uint64_t size, const char *buffer) {
+        return write_at<0>(addr, size, buffer);
+    }
+    template <typename T>
+    bool read(uint64_t addr, T &value) {
+        return read_at<0>(addr, sizeof(T), (char*)&value);
+    }
+    template <typename T>
+    bool write(uint64_t addr, T value) {
+        return write_at<0>(addr, sizeof(T), (const char*)&value);
+    }
+    bool get_dmi(uint64_t addr, dmi_region &region) {
+        return dmi_at<0>(addr, region);
+    }
+    void set_dmi_listener(std::function<void()> listener) {
+        dmi_listener = listener;
+    }
+private:
+    template <size_t i>
+    using range_at = typename std::tuple_element<i, std::tuple<ranges...> >::type;
+    static constexpr uint64_t starts[sizeof...(ranges) + 1] = {ranges::start..., 0};
+    static constexpr uint64_t ends[sizeof...(ranges) + 1] = {ranges::end..., 0};
+    static constexpr bool disjoint() {
+        for (size_t i = 0; i < sizeof...(ranges); i++) {
+            for (size_t j = i + 1; j < sizeof...(ranges); j++) {
+                if (starts[i] < ends[j] && starts[j] < ends[i]) return false;
+            }
+        }
+        return true;
+    }
+    static_assert(disjoint(), "static_map ranges overlap");
+    // The qualified calls below bind at compile time, devices should not be further derived.
+    template <size_t i>
+    bool read_at(uint64_t addr, uint64_t size, char *buffer) {
+        if constexpr (i == sizeof...(ranges)) return dynamic.read(addr, size, buffer);
+        else {
+            typedef range_at<i> r;
+            typedef typename r::device_type dev_t;
+            if (r::start <= addr && addr + size <= r::end) {
+                return std::get<i>(devs).dev_t::do_read(r::raw ? addr : addr - r::start, size, buffer);
+            }
+            return read_at<i + 1>(addr, size, buffer);
+        }
+    }
+    template <size_t i>
+    bool write_at(uint64_t addr, uint64_t size, const char *buffer) {
+        if constexpr (i == sizeof...(ranges)) return dynamic.write(addr, size, buffer);
+        else {
+            typedef range_at<i> r;
+            typedef typename r::device_type dev_t;
+            if (r::start <= addr && addr + size <= r::end) {
+                return std::get<i>(devs).dev_t::do_write(r::raw ? addr : addr - r::start, size, buffer);
+            }
+            return write_at<i + 1>(addr, size, buffer);
+        }
+    }
+    template <size_t i>
+    bool dmi_at(uint64_t addr, dmi_region &region) {
+        if constexpr (i == sizeof...(ranges)) return dynamic.get_dmi(addr, region);
+        else {
+            typedef range_at<i> r;
+            if (r::start <= addr && addr < r::end) {
+                return device_map::clip_dmi(&std::get<i>(devs), r::start, r::end, r::raw, addr, region);
+            }
+            return dmi_at<i + 1>(addr, region);
+        }
+    }
+    std::tuple<typename ranges::device_type&...> devs;
+    device_map dynamic;
+    std::function<void()> dmi_listener;
+};
+
+#endif